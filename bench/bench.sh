@@ -0,0 +1,147 @@
+#!/bin/sh
+# benchmark of pcimax-ctl against the card emulator (make bench)
+#
+# scenarios:
+#   full	config.ini applied from scratch (one-shot runs, --force)
+#   rt, af, ps	a single setting changed in --monitor mode
+# reported per scenario: commands and bytes per apply and
+# the mean, p50 and p99 latency from the config change (or program start)
+# to the last byte received by the card. The result is printed as JSON.
+#
+# environment:
+#   BENCH_RUNS	applies per scenario, default 20
+#   BENCH_BUSY	time the emulated card needs per command (ms), default 0
+#   BENCH_DELAY	--delay of pcimax-ctl (ms), default: pcimax-ctl default
+#   BENCH_CONFIG	base config, default config.ini
+
+set -e
+
+CTL=${CTL:-./pcimax-ctl}
+EMU=${EMU:-./pcimax-emu}
+RUNS=${BENCH_RUNS:-20}
+BUSY=${BENCH_BUSY:-0}
+CONFIG=${BENCH_CONFIG:-config.ini}
+
+WORK=$(mktemp -d /tmp/pcimax-bench.XXXXXX)
+DEV=$WORK/card
+STATS=$WORK/stats
+EMU_PID=
+CTL_PID=
+
+cleanup() {
+	# stop pcimax-ctl first, it restores the line settings on exit
+	if [ -n "$CTL_PID" ]; then
+		kill "$CTL_PID" 2>/dev/null || :
+		wait "$CTL_PID" 2>/dev/null || :
+	fi
+	[ -n "$EMU_PID" ] && kill "$EMU_PID" 2>/dev/null || :
+	wait 2>/dev/null || :
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# keep away from a running daemon and the system state
+CTL_ARGS="--device=$DEV --state-dir=$WORK/state --socket=$WORK/sock"
+[ -n "$BENCH_DELAY" ] && CTL_ARGS="$CTL_ARGS --delay=$BENCH_DELAY"
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# value of a counter of the emulator
+counter() {
+	awk -v key="$1" '$1 == key { print $2 }' "$STATS"
+}
+
+# waits until the emulator received data and the line stayed quiet for
+# 500ms (pcimax-ctl waits at most --delay ms between two commands), gives
+# up after 10s without any data
+wait_idle() {
+	before=$1
+	last=$1
+	idle=0
+	waited=0
+	while [ "$idle" -lt 10 ] && [ "$waited" -lt 200 ]; do
+		sleep 0.05
+		now=$(counter bytes)
+		if [ "$now" = "$before" ] || [ "$now" != "$last" ]; then
+			idle=0
+		else
+			idle=$((idle + 1))
+		fi
+		[ "$now" = "$before" ] && waited=$((waited + 1))
+		last=$now
+	done
+}
+
+# mean, p50 and p99 of the latencies (ms) in a file
+latencies() {
+	sort -n "$1" | awk '{ v[NR] = $1; sum += $1 }
+		END {
+			p50 = int((NR * 50 + 99) / 100); p99 = int((NR * 99 + 99) / 100)
+			printf "\"apply_ms\": %.1f, \"latency_p50_ms\": %d, \"latency_p99_ms\": %d", \
+			       sum / NR, v[p50], v[p99]
+		}'
+}
+
+# prints the JSON object of a scenario
+# @1: name, @2: commands, @3: bytes (sums of all runs)
+report() {
+	printf '    {"name": "%s", "runs": %d, "commands": %d, "bytes": %d, %s}' \
+		"$1" "$RUNS" "$(($2 / RUNS))" "$(($3 / RUNS))" \
+		"$(latencies "$WORK/latency")"
+}
+
+"$EMU" --link="$DEV" --answer --busy="$BUSY" --stats="$STATS" >/dev/null &
+EMU_PID=$!
+while [ ! -e "$STATS" ]; do sleep 0.01; done
+
+printf '{\n  "version": "%s",\n  "busy_ms": %d,\n  "scenarios": [\n' \
+	"$(git describe --always --dirty 2>/dev/null || echo unknown)" "$BUSY"
+
+# full apply, from program start to the last byte
+: > "$WORK/latency"
+commands=$(counter commands)
+bytes=$(counter bytes)
+i=0
+while [ "$i" -lt "$RUNS" ]; do
+	t0=$(now_us)
+	"$CTL" --file="$CONFIG" $CTL_ARGS --force >/dev/null || :
+	echo "$((($(counter last_byte_us) - t0) / 1000))" >> "$WORK/latency"
+	i=$((i + 1))
+done
+report full "$(($(counter commands) - commands))" "$(($(counter bytes) - bytes))"
+
+# single setting changes, picked up by the monitor mode
+cp "$CONFIG" "$WORK/config.ini"
+"$CTL" --file="$WORK/config.ini" $CTL_ARGS --monitor --debounce=0 \
+	>/dev/null 2>"$WORK/monitor.log" &
+CTL_PID=$!
+wait_idle 0
+
+for scenario in rt af ps; do
+	: > "$WORK/latency"
+	commands=$(counter commands)
+	bytes=$(counter bytes)
+	i=0
+	while [ "$i" -lt "$RUNS" ]; do
+		case $scenario in
+		rt) line="rt = now playing: track $i of $RUNS" ;;
+		af) line="af = 98.$((i % 10)) 101.1,102" ;;
+		ps) line="ps = RADIO$i" ;;
+		esac
+		sed "s/^$scenario *=.*/$line/" "$WORK/config.ini" > "$WORK/config.new"
+		before=$(counter bytes)
+		t0=$(now_us)
+		# rename on save, like most editors
+		mv "$WORK/config.new" "$WORK/config.ini"
+		wait_idle "$before"
+		echo "$((($(counter last_byte_us) - t0) / 1000))" >> "$WORK/latency"
+		i=$((i + 1))
+	done
+	printf ',\n'
+	report "$scenario" "$(($(counter commands) - commands))" \
+		"$(($(counter bytes) - bytes))"
+done
+
+printf '\n  ]\n}\n'
@@ -13,8 +13,9 @@ http://code.google.com/p/inih/
 
 #include "ini.h"
 
-#define MAX_LINE 200
-#define MAX_SECTION 50
+#define MAX_LINE 256
+/* a section name always fits, [card:<id>] sections hold device paths */
+#define MAX_SECTION MAX_LINE
 #define MAX_NAME 50
 
 /* Strip whitespace chars off end of given string, in place. Return s. */
@@ -97,9 +98,13 @@ int ini_parse_file(FILE* file,
                 strncpy0(section, start + 1, sizeof(section));
                 *prev_name = '\0';
             }
-            else if (!error) {
-                /* No ']' found on section line */
-                error = lineno;
+            else {
+                /* No ']' found on section line (or the line was too
+                   long), its values don't belong to the previous one */
+                *section = '\0';
+                *prev_name = '\0';
+                if (!error)
+                    error = lineno;
             }
         }
         else if (*start && *start != ';') {
@@ -0,0 +1,1528 @@
+/*
+ * Copyright 2012 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ * Author: Konke Radlow <koradlow@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA  02110-1335  USA
+ */
+
+/* libpcimax: command framing, encoding of the settings, serial line setup
+ * and device discovery of the pcimax3000+ cards, see pcimax.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <string.h>	/* String function definitions */
+#include <unistd.h>	/* UNIX standard function definitions */
+#include <fcntl.h>	/* File control definitions */
+#include <errno.h>	/* Error number definitions */
+#include <termios.h>	/* POSIX terminal control definitions */
+#include <time.h>
+#include <libudev.h>
+
+#include "pcimax.h"
+
+/* an opened card, see pcimax_open */
+struct pcimax {
+	int fd;			/* serial line */
+	struct termios old_settings;	/* setup of the line before */
+	uint32_t delay;		/* max time per command in ms */
+	struct pcimax_values values;	/* settings the card got */
+};
+
+/* returns the value of the monotonic clock in ms */
+static int64_t pcimax_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* @ret_val:	false on error */
+static bool pcimax_set_settings(int fd, const struct termios *settings)
+{
+	/* TSCNOW -> change occurs immediately */
+	tcflush(fd, TCIFLUSH);
+	return tcsetattr(fd, TCSANOW, settings) == 0;
+}
+
+/* open the serial line and place it into PCIMAX3000+ compatible mode
+ * @old:	set to the previous setup of the line
+ * @ret_val:	file descriptor of the serial line, negative errno value on
+ *		error */
+/* TODO: figure out the minimal set of settings for proper communication */ 
+int pcimax_serial_open(const char *device, struct termios *old)
+{
+	struct termios new_settings;
+	uint32_t modem_ctl_ioctl;
+	int err;
+	int fd;
+
+	/* O_NONBLOCK -> return immediately
+	 * O_NOCTTY -> we're not the controlling terminal */
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	/* Get the current settings for the port */
+	if (tcgetattr(fd, old)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	new_settings = *old;
+
+	/* adopt the settings according to the requirements of the 
+	 * PCIMAX3000+ card */
+	new_settings.c_cflag = B9600 | CS8 | CREAD | CLOCAL;
+	new_settings.c_cflag &= ~CRTSCTS;
+	new_settings.c_iflag = IGNBRK;
+	new_settings.c_oflag = ONLCR;
+	new_settings.c_lflag = ECHOE | ECHOK | NOFLSH | ECHOCTL;
+	new_settings.c_line = 0;
+	new_settings.c_cc[VMIN] = 0;
+	new_settings.c_cc[VTIME] = 0;
+	new_settings.c_cc[VEOF] = 26; /* => ^Z */
+	/* disable {SUSP,  REPRINT, WERASE, LNEXT} characters */ 
+	new_settings.c_cc[VSUSP] = fpathconf(fd, _PC_VDISABLE);
+	new_settings.c_cc[VREPRINT] = fpathconf(fd, _PC_VDISABLE);
+	new_settings.c_cc[VWERASE] = fpathconf(fd, _PC_VDISABLE);
+	new_settings.c_cc[VLNEXT] = fpathconf(fd, _PC_VDISABLE);
+
+	/* Set the baud rates to 9600 */
+	cfsetispeed(&new_settings, B9600);
+	cfsetospeed(&new_settings, B9600);
+
+	/* enable the Request to Send line & Data Terminal Ready*/
+	ioctl(fd, TIOCMGET, &modem_ctl_ioctl);
+	modem_ctl_ioctl |= TIOCM_RTS | TIOCM_DTR;
+	ioctl(fd, TIOCMSET, &modem_ctl_ioctl);
+
+	if (!pcimax_set_settings(fd, &new_settings)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/* restores the setup the serial line had before pcimax_serial_open and
+ * closes it */
+void pcimax_serial_close(int fd, const struct termios *old)
+{
+	pcimax_set_settings(fd, old);
+	close(fd);
+}
+
+/* writes as much of the buffers in @iov to the serial line as it accepts
+ * handles partial writes
+ * @iov:	array of buffers, advanced past the written data
+ * @iovcnt:	number of buffers in @iov, updated
+ * @ret_val:	1 if everything was written, 0 if the (non-blocking) fd
+ *		can't take more data right now, negative errno value on
+ *		error */
+int pcimax_write_iov(int fd, struct iovec **iov, int *iovcnt)
+{
+	ssize_t wr_count;
+
+	while (*iovcnt > 0) {
+		wr_count = writev(fd, *iov, *iovcnt > UIO_MAXIOV ? UIO_MAXIOV : *iovcnt);
+		if (wr_count == -1) {
+			if (errno == EINTR)
+				continue;
+			/* output buffer full, continue when it drained */
+			if (errno == EAGAIN)
+				return 0;
+			return -errno;
+		}
+		/* skip the buffers that were written completely and advance
+		 * into the buffer that was written partially */
+		while (*iovcnt > 0 && (size_t)wr_count >= (*iov)->iov_len) {
+			wr_count -= (*iov)->iov_len;
+			(*iov)++;
+			(*iovcnt)--;
+		}
+		if (*iovcnt > 0) {
+			(*iov)->iov_base = (char *)(*iov)->iov_base + wr_count;
+			(*iov)->iov_len -= wr_count;
+		}
+	}
+	return 1;
+}
+
+/* writes a frame, waits for the serial line to accept it
+ * @ret_val:	0, negative errno value on error */
+int pcimax_frame_write(int fd, const struct pcimax_frame *frame)
+{
+	struct iovec iov = { .iov_base = (void *)frame->buf, .iov_len = frame->len };
+	struct iovec *next = &iov;
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int left = 1;
+	int ret;
+
+	while ((ret = pcimax_write_iov(fd, &next, &left)) == 0)
+		poll(&pfd, 1, -1);
+	return ret > 0 ? 0 : ret;
+}
+
+/* waits until the card answered the last command, i.e. no further bytes
+ * arrived for PCIMAX_QUIET_MS, or until @deadline (monotonic ms) for cards
+ * that don't answer */
+static void pcimax_answer_wait(int fd, int64_t deadline)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int64_t ready = deadline;
+	char buffer[64];
+	int64_t now;
+
+	while ((now = pcimax_now_ms()) < ready) {
+		if (poll(&pfd, 1, (int)(ready - now)) <= 0)
+			continue;
+		while (read(fd, buffer, sizeof(buffer)) > 0)
+			;
+		ready = pcimax_now_ms() + PCIMAX_QUIET_MS;
+		if (ready > deadline)
+			ready = deadline;
+	}
+}
+
+/* checks if a tty device belongs to a pcimax3000+ card, by comparing the
+ * Vendor and Product ID of the USB-to-Serial IC it is connected to
+ * @serial:	buffer of PCIMAX_SERIAL_MAX bytes for the USB serial of the
+ *		card, empty if it is unknown, may be NULL */
+bool pcimax_is_card(struct udev_device *dev, char *serial)
+{
+	struct udev_device *parent;
+	const char *product_buf;
+	const char *vendor_buf;
+	const char *serial_buf;
+
+	/* to get information about the device, get the parent device 
+	 * with the subsystem/devtype pair of "usb"/"usb_device",
+	 * the parent is owned by dev */
+	parent = udev_device_get_parent_with_subsystem_devtype(
+	       dev, "usb", "usb_device");
+	if (!parent)
+		return false;
+
+	/* check if the tty device matches the USB to Serial 
+	 * converter that's used on the pcimax3000+ card */
+	product_buf = udev_device_get_sysattr_value(parent, "idProduct");
+	vendor_buf = udev_device_get_sysattr_value(parent, "idVendor");
+	if (!product_buf || !vendor_buf ||
+	    strncmp(PCIMAX_PRODUCT_ID, product_buf, 4) ||
+	    strncmp(PCIMAX_VENDOR_ID, vendor_buf, 4))
+		return false;
+	if (serial) {
+		serial_buf = udev_device_get_sysattr_value(parent, "serial");
+		snprintf(serial, PCIMAX_SERIAL_MAX, "%s", serial_buf ? serial_buf : "");
+	}
+	return true;
+}
+
+/* results of a device scan */
+struct pcimax_scan {
+	struct pcimax_device *devices;
+	size_t max;
+	size_t count;
+};
+
+/* adds a tty device to the found devices, if it belongs to a pcimax3000+
+ * card
+ * @checked:	the device is already known to be a card */
+static void pcimax_found_device(struct pcimax_scan *scan,
+				struct udev_device *dev, bool checked)
+{
+	struct udev_list_entry *link;
+	struct pcimax_device *device;
+	const char *devnode = udev_device_get_devnode(dev);
+	const char *syspath = udev_device_get_syspath(dev);
+	const char *name;
+
+	if (!devnode || scan->count >= scan->max)
+		return;
+	device = &scan->devices[scan->count];
+	memset(device, 0, sizeof(*device));
+	if (!pcimax_is_card(dev, device->serial) && !checked)
+		return;
+	scan->count++;
+	snprintf(device->device, sizeof(device->device), "%s", devnode);
+	if (syspath)
+		snprintf(device->syspath, sizeof(device->syspath), "%s", syspath);
+	/* remember the stable name of the card, e.g. for a device cache */
+	udev_list_entry_foreach(link, udev_device_get_devlinks_list_entry(dev)) {
+		name = udev_list_entry_get_name(link);
+		if (strncmp(name, PCIMAX_BY_ID_DIR "/", strlen(PCIMAX_BY_ID_DIR) + 1) == 0) {
+			snprintf(device->link, sizeof(device->link), "%s", name);
+			break;
+		}
+	}
+}
+
+/* searches the tty devices for pcimax3000+ cards
+ * @filtered:	let udev match the product / vendor id of the USB to serial
+ *		IC (properties of the udev database), instead of checking
+ *		the USB parent of every tty device of the system
+ * code inspired by: http://www.signal11.us/oss/udev/ */
+static void pcimax_scan_devices(struct pcimax_scan *scan, struct udev *udev,
+				bool filtered)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *dev_list_entry;
+	struct udev_device *dev;
+	const char *vendor_buf;
+
+	/* create a list of the devices in the 'tty' subsystem, property
+	 * matches are or'ed by udev, so the vendor is checked below */
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate)
+		return;
+	udev_enumerate_add_match_subsystem(enumerate, "tty");
+	if (filtered)
+		udev_enumerate_add_match_property(enumerate, "ID_MODEL_ID",
+						  PCIMAX_PRODUCT_ID);
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(dev_list_entry,
+				udev_enumerate_get_list_entry(enumerate)) {
+		/* get the filename of the /sys entry for the device
+		 * create a udev_device object (dev) representing it */
+		dev = udev_device_new_from_syspath(udev,
+				udev_list_entry_get_name(dev_list_entry));
+		if (!dev)
+			continue;
+		if (!filtered) {
+			pcimax_found_device(scan, dev, false);
+		} else {
+			vendor_buf = udev_device_get_property_value(dev, "ID_VENDOR_ID");
+			if (vendor_buf && strcmp(vendor_buf, PCIMAX_VENDOR_ID) == 0)
+				pcimax_found_device(scan, dev, true);
+		}
+		udev_device_unref(dev);
+	}
+	/* free the enumerator object */
+	udev_enumerate_unref(enumerate);
+}
+
+/* auto-detects the connected pcimax3000+ cards, by comparing the Vendor and
+ * Product ID for the USB-to-Serial IC to all tty devices of the system
+ * @ret_val:	number of cards stored in @devices, negative errno value on
+ *		error */
+int pcimax_discover(struct pcimax_device *devices, size_t max)
+{
+	struct pcimax_scan scan = { devices, max, 0 };
+	struct udev *udev;
+
+	/* create the udev object */
+	udev = udev_new();
+	if (!udev)
+		return -ENOMEM;
+	/* without an udev database (e.g. in containers) the properties are
+	 * missing, fall back to checking every tty device */
+	pcimax_scan_devices(&scan, udev, true);
+	if (!scan.count)
+		pcimax_scan_devices(&scan, udev, false);
+	udev_unref(udev);
+	return scan.count;
+}
+
+/* looks up the USB serial number and the sysfs path of the card behind its
+ * tty device */
+void pcimax_identify(struct pcimax_device *device)
+{
+	struct udev *udev = NULL;
+	struct udev_device *dev = NULL;
+	struct udev_device *parent;
+	const char *value;
+	struct stat st;
+
+	if (stat(device->device, &st) == 0 && S_ISCHR(st.st_mode))
+		udev = udev_new();
+	if (udev)
+		dev = udev_device_new_from_devnum(udev, 'c', st.st_rdev);
+	if (dev) {
+		value = udev_device_get_syspath(dev);
+		if (value && !device->syspath[0])
+			snprintf(device->syspath, sizeof(device->syspath), "%s", value);
+		/* the parent is owned by dev, no need to unref it */
+		parent = udev_device_get_parent_with_subsystem_devtype(
+			dev, "usb", "usb_device");
+		value = parent ? udev_device_get_sysattr_value(parent, "serial") : NULL;
+		if (value)
+			snprintf(device->serial, sizeof(device->serial), "%s", value);
+		udev_device_unref(dev);
+	}
+	if (udev)
+		udev_unref(udev);
+}
+
+/* empties a plan
+ * @note:	receives the descriptions of the encoded values, NULL to
+ *		stay quiet */
+void pcimax_plan_init(struct pcimax_plan *plan, void (*note)(const char *text))
+{
+	plan->count = 0;
+	plan->note = note;
+}
+
+
+/* appends a command to the plan, framed as it is sent over the line:
+ * 0x00 <cmd> 0x01 <data> 0x02
+ * @cmd:	c string or char array with terminating null byte
+ * @field:	PCIMAX_* bit of the setting the command belongs to
+ * @data:	c string or char array 
+ * @data_count:	number of data bytes to transmit
+ * @ret_val:	false if the command doesn't fit into the plan */
+bool pcimax_plan_add(struct pcimax_plan *plan, uint32_t field,
+		     const char *cmd, const char *data, size_t data_count)
+{
+	static const char start = 0x00;		/* start of new command */
+	static const char end_cmd = 0x01;	/* eof command, sof data */
+	static const char finish = 0x02;	/* eof data */ 
+	struct pcimax_frame *frame;
+	size_t cmd_count = strlen(cmd);
+
+	if (plan->count >= PCIMAX_PLAN_MAX || cmd_count > PCIMAX_CMD_MAX ||
+	    data_count > PCIMAX_DATA_MAX)
+		return false;
+	frame = &plan->frames[plan->count++];
+	frame->field = field;
+	frame->len = 0;
+	frame->buf[frame->len++] = start;
+	memcpy(&frame->buf[frame->len], cmd, cmd_count);
+	frame->len += cmd_count;
+	frame->buf[frame->len++] = end_cmd;
+	memcpy(&frame->buf[frame->len], data, data_count);
+	frame->len += data_count;
+	frame->buf[frame->len++] = finish;
+	return true;
+}
+
+/* copies the command mnemonic of a frame into @cmd (PCIMAX_CMD_MAX + 1) */
+void pcimax_frame_cmd(const struct pcimax_frame *frame, char *cmd)
+{
+	uint8_t i;
+
+	for (i = 0; i < PCIMAX_CMD_MAX && frame->buf[i + 1] != 0x01; i++)
+		cmd[i] = frame->buf[i + 1];
+	cmd[i] = '\0';
+}
+
+
+/* replaces terminating null characters in char arrays (strings) with spaces
+ * @string:	ptr to a char array
+ * @replacement:character used for replacement
+ * @length:	length of the array
+ * used to modify strings so that their whole length will be sent over the
+ * serial line, in order to overwrite remainings of old strings */
+static void pcimax_replace_terminating_null(char *string, char replacement, uint32_t length)
+{
+	for(uint32_t i = 0; i < length; i++) {
+		if (string[i] == '\0')
+			string[i] = replacement;
+	}
+}
+
+/* encodes the integer frequency value into a string representation
+ * @freq:	integer range 87500..108000 
+ * @freq_str:	buffer of 3 bytes for the \0 terminated result
+ * @ret_val:	@freq_str */
+static const char* pcimax_get_freq(uint32_t new_freq, char *freq_str)
+{
+	char high_byte = 0;
+	char low_byte = 0;
+	uint32_t freq_fifth = (uint32_t)(new_freq / 5);
+	
+	/* chars 0x00, 0x01, 0x02 are reserved as special control characters
+	 * by the device -> add 4 to results */
+	high_byte = (char)((uint32_t)(freq_fifth / 128) + 4);
+	low_byte = (char)((freq_fifth - (uint32_t)(freq_fifth / 128) * 128) + 4);
+	freq_str[0] = low_byte;
+	freq_str[1] = high_byte;
+	freq_str[2] = '\0';
+	return freq_str;
+}
+
+/* encodes the integer power value into a string representation
+ * @power:	interger range 0..100
+ * @power_str:	buffer of 2 bytes for the \0 terminated result
+ * @ret_val:	@power_str */
+static const char* pcimax_get_power(uint8_t power, char *power_str)
+{
+	/* valid range of values for RDS encoder 0x03..0x19 */
+	power_str[0] = 0x19;
+	power_str[1] = '\0';
+	if (power <= 100)
+		power_str[0] = (char)(power / 100.0f * 21) + 4;
+	return power_str;
+}
+
+/* pcimax3000+ protocol expects a trans-coded alternative frequency 
+ * representation. The lowest possible frequency 87.6MHz maps to 1, and
+ * the frequency is increased  by 0.1MHz per step, so that the
+ * highest possible frequency 108MHz maps to 205 */ 
+static char pcimax_get_af_code(uint32_t freq)
+{
+	/* +4 -> add the offset to skip the reserved control codes */
+	return (freq - 87500) / 100 + 4;
+}
+
+
+/* @ret_val:	PCIMAX_FM or PCIMAX_RDS, the group of a setting */
+static uint32_t pcimax_key_group(const struct pcimax_key *key)
+{
+	return (key->bit & PCIMAX_FM_FIELDS) ? PCIMAX_FM : PCIMAX_RDS;
+}
+
+/* parsers of the values as given in the config file or on the command
+ * line, they mark the setting as defined
+ * @ret_val:	false if the value is invalid */
+static bool pcimax_parse_freq(struct pcimax_values *settings,
+			      const struct pcimax_key *key, const char *value)
+{
+	settings->defined |= key->bit | pcimax_key_group(key);
+	settings->freq = strtod(value, NULL) * 1000;
+	return true;
+}
+
+static bool pcimax_parse_power(struct pcimax_values *settings,
+			       const struct pcimax_key *key, const char *value)
+{
+	int i = strtol(value, 0L, 0);
+
+	settings->defined |= key->bit | pcimax_key_group(key);
+	settings->power = (i >= 0 && i <= 100)? i : 100;
+	return true;
+}
+
+/* true / false, everything but "false" is true */
+static bool pcimax_parse_flag(struct pcimax_values *settings,
+			      const struct pcimax_key *key, const char *value)
+{
+	settings->defined |= key->bit | pcimax_key_group(key);
+	*((char *)settings + key->offset) = strcmp(value, "false")? '1' : '0';
+	return true;
+}
+
+/* music / speech, or true / false as documented for --set-ms */
+static bool pcimax_parse_ms(struct pcimax_values *settings,
+			    const struct pcimax_key *key, const char *value)
+{
+	settings->defined |= key->bit | pcimax_key_group(key);
+	settings->ms = (strcmp(value, "music") == 0 ||
+			strcmp(value, "true") == 0)? '1' : '0';
+	return true;
+}
+
+/* text, cut to the max length of the setting */
+static bool pcimax_parse_text(struct pcimax_values *settings,
+			      const struct pcimax_key *key, const char *value)
+{
+	char *text = (char *)settings + key->offset;
+
+	settings->defined |= key->bit | pcimax_key_group(key);
+	/* the values are compared as a whole, no leftovers of a longer
+	 * text may remain */
+	memset(text, 0, key->size);
+	strncpy(text, value, key->size - 1);
+	return true;
+}
+
+/* the dynamic PS slots are cleared along with the station name */
+static bool pcimax_parse_ps(struct pcimax_values *settings,
+			    const struct pcimax_key *key, const char *value)
+{
+	settings->defined |= PCIMAX_PS_SLOTS;
+	return pcimax_parse_text(settings, key, value);
+}
+
+static bool pcimax_parse_pi(struct pcimax_values *settings,
+			    const struct pcimax_key *key, const char *value)
+{
+	int tmp = 0;
+
+	settings->defined |= key->bit | pcimax_key_group(key);
+	if (value[0] == '0' && value[1] == 'x')
+		tmp = strtol(value, NULL, 16);
+	else
+		tmp = strtol(value, NULL, 10);
+	settings->pi[1] = (uint8_t) tmp & 0Xff;
+	settings->pi[0] = (uint8_t) (tmp >> 8) & 0x0ff;
+	return true;
+}
+
+/* 0..4, e0..e4 or E0..E4, the card doesn't support other codes */
+static bool pcimax_parse_ecc(struct pcimax_values *settings,
+			     const struct pcimax_key *key, const char *value)
+{
+	if (value[0] == 'e' || value[0] == 'E')
+		value++;
+	if (value[0] < '0' || value[0] > '4')
+		return false;
+	settings->defined |= key->bit | pcimax_key_group(key);
+	/* the card expects values from 1 to 5, but the codes
+	 * are specified as E0..E4 --> add +1 */
+	settings->ecc = (char)strtol(value, NULL, 10) + 1;
+	return true;
+}
+
+/* list of frequencies, separated by ',' or ' ' */
+static bool pcimax_parse_af(struct pcimax_values *settings,
+			    const struct pcimax_key *key, const char *value)
+{
+	char buffer[10];
+	uint32_t af[7] = { 0 };
+	uint8_t af_size = 0;
+	int length = strlen(value);
+	int pos = 0;
+	int start = 0;
+
+	/* find sub-strings, delimited by ',' or ' ' and convert them into
+	 * integer values */
+	while(pos <= length) {
+		if (value[pos] == ',' || value[pos] == ' ' || pos == length) {
+			/* no frequency has that many digits, the token would
+			 * overflow the buffer */
+			if (pos - start >= (int)sizeof(buffer))
+				return false;
+			memset(buffer, 0, sizeof(buffer));
+			strncpy(buffer, &value[start], pos-start);
+			af[af_size++] = strtof(buffer, NULL) * 1000.0f;
+			start = pos + 1 ;
+			/* pcimax3000+ supports only 7 AFs */
+			if (af_size >= 7)
+				break;
+		}
+		pos++;
+	}
+	/* a new list replaces the old one, the unused entries are cleared
+	 * so that the lists can be compared as a whole */
+	memcpy(settings->af, af, sizeof(settings->af));
+	settings->af_size = af_size;
+	settings->defined |= key->bit | pcimax_key_group(key);
+	return true;
+}
+
+/* formatters of the values, the same way they're given in the config
+ * file, so that they can be parsed again
+ * @buf:	buffer of PCIMAX_VALUE_MAX bytes for the result */
+static void pcimax_format_freq(const struct pcimax_values *settings,
+			       const struct pcimax_key *key, char *buf)
+{
+	sprintf(buf, "%.1f", settings->freq / 1000.0f);
+}
+
+static void pcimax_format_power(const struct pcimax_values *settings,
+				const struct pcimax_key *key, char *buf)
+{
+	sprintf(buf, "%u", settings->power);
+}
+
+static void pcimax_format_flag(const struct pcimax_values *settings,
+			       const struct pcimax_key *key, char *buf)
+{
+	const char *flag = (const char *)settings + key->offset;
+
+	strcpy(buf, (*flag == '1') ? "true" : "false");
+}
+
+static void pcimax_format_ms(const struct pcimax_values *settings,
+			     const struct pcimax_key *key, char *buf)
+{
+	strcpy(buf, (settings->ms == '1') ? "music" : "speech");
+}
+
+static void pcimax_format_text(const struct pcimax_values *settings,
+			       const struct pcimax_key *key, char *buf)
+{
+	strcpy(buf, (const char *)settings + key->offset);
+}
+
+static void pcimax_format_pi(const struct pcimax_values *settings,
+			     const struct pcimax_key *key, char *buf)
+{
+	sprintf(buf, "0x%02x%02x", settings->pi[0], settings->pi[1]);
+}
+
+static void pcimax_format_ecc(const struct pcimax_values *settings,
+			      const struct pcimax_key *key, char *buf)
+{
+	sprintf(buf, "%d", settings->ecc - 1);
+}
+
+static void pcimax_format_af(const struct pcimax_values *settings,
+			     const struct pcimax_key *key, char *buf)
+{
+	int len = 0;
+
+	buf[0] = '\0';
+	for (uint8_t i = 0; i < settings->af_size; i++)
+		len += sprintf(buf + len, "%s%.1f", i ? "," : "",
+			       settings->af[i] / 1000.0f);
+}
+
+/* passes a description of an encoded value on to the note callback of
+ * the plan */
+static void pcimax_note(const struct pcimax_plan *plan, const char *format, ...)
+{
+	char text[PCIMAX_VALUE_MAX];
+	va_list args;
+
+	if (!plan->note)
+		return;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	plan->note(text);
+}
+
+/* encoders of the settings, they add the commands that transfer the value
+ * to the card to a plan */
+
+/* TODO: do the power & stereo settings have any effect?
+ * -> submitting a value for "F0" command yields in no detectable transmission */
+static void pcimax_encode_stereo(struct pcimax_plan *plan,
+				 const struct pcimax_values *settings,
+				 const struct pcimax_key *key)
+{
+	pcimax_note(plan, "Setting transmitter to %s mode\n",
+		(settings->is_stereo == '1') ? "stereo" : "mono");
+	pcimax_plan_add(plan, key->bit, key->cmd, &settings->is_stereo, 1);
+}
+
+static void pcimax_encode_freq(struct pcimax_plan *plan,
+			       const struct pcimax_values *settings,
+			       const struct pcimax_key *key)
+{
+	char buffer[3];
+
+	pcimax_note(plan, "Setting transmitter to %.1fMHz\n", (settings->freq / 1000.0f));
+	pcimax_plan_add(plan, key->bit, key->cmd,
+			pcimax_get_freq(settings->freq, buffer), 2);
+}
+
+static void pcimax_encode_power(struct pcimax_plan *plan,
+				const struct pcimax_values *settings,
+				const struct pcimax_key *key)
+{
+	char buffer[2];
+
+	pcimax_note(plan, "Setting transmitter power to %d%%\n", settings->power);
+	pcimax_plan_add(plan, key->bit, key->cmd,
+			pcimax_get_power(settings->power, buffer), 1);
+}
+
+/* TODO: add Country code and AreaCoverage fields to settings, or calculate them
+ * from the given PI code */
+/* RDS-Standard for short range transmitters:
+ * (see IEC62106: Annex D table D.5)
+ * bits 0-7: Program reference number
+ * bits 8-11: Program in terms of area coverage
+ * 	1 (hex) when device uses an AF list
+ * 	0 (hex) when no AF list is used
+ * bits 12-15: Country code - a fixed value between 0x01 and 0x0f
+ * atm the program will not enforce these values but let the user
+ * select the PI code freely (might be changed) */
+static void pcimax_encode_pi(struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     const struct pcimax_key *key)
+{
+	char buffer[4];
+
+	pcimax_note(plan, "Setting RDS PI to 0x%02x%02x\n", settings->pi[0],
+		settings->pi[1]);
+	/* low byte of PI */
+	sprintf(buffer, "%03u", settings->pi[0]);
+	pcimax_plan_add(plan, key->bit, "CCAC", buffer, 3);
+	/* Program reference, high byte of PI */
+	sprintf(buffer, "%03u", settings->pi[1]);
+	pcimax_plan_add(plan, key->bit, "PREF", buffer, 3);
+}
+
+static void pcimax_encode_pty(struct pcimax_plan *plan,
+			      const struct pcimax_values *settings,
+			      const struct pcimax_key *key)
+{
+	char buffer[3];
+
+	pcimax_note(plan, "Setting RDS PTY to %s\n", settings->pty);
+	/* always two digits, a single digit code would send the
+	 * terminating null, the start of a new command */
+	sprintf(buffer, "%02u", (unsigned int)atoi(settings->pty) % 100);
+	pcimax_plan_add(plan, key->bit, key->cmd, buffer, 2);
+}
+
+/* single character flags: TP, TA, MS */
+static void pcimax_encode_flag(struct pcimax_plan *plan,
+			       const struct pcimax_values *settings,
+			       const struct pcimax_key *key)
+{
+	char value[PCIMAX_VALUE_MAX];
+
+	key->format(settings, key, value);
+	pcimax_note(plan, "Setting RDS %s flag to %s\n", key->cmd, value);
+	pcimax_plan_add(plan, key->bit, key->cmd,
+			(const char *)settings + key->offset, 1);
+}
+
+/* Decoder Information, all four flags are sent together */
+static void pcimax_encode_di(struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     const struct pcimax_key *key)
+{
+	pcimax_note(plan, "Setting RDS Decoder Information flags\n");
+	pcimax_note(plan, "  --> mode: %s, artificial head: %c, \n  --> compression: %c, dynamic PTY: %c\n",
+		(settings->is_stereo == '1')? "stereo" : "mono", settings->di_artificial,
+		settings->di_compression, settings->di_dynamic_pty);
+	/* use the FM-Transmitter setting for mono/stereo flag */
+	pcimax_plan_add(plan, key->bit, "Did0", &settings->is_stereo, 1);
+	pcimax_plan_add(plan, key->bit, "Did1", &settings->di_artificial, 1); /* artificial head */
+	pcimax_plan_add(plan, key->bit, "Did2", &settings->di_compression, 1); /* compression */
+	pcimax_plan_add(plan, key->bit, "Did3", &settings->di_dynamic_pty, 1); /* dynamic PTY */
+}
+
+/* n AF + magic number + offset = number of defined AFs
+ * maximal AFs = 7 */
+static void pcimax_encode_af(struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     const struct pcimax_key *key)
+{
+	char buffer[4];
+
+	buffer[0] = settings->af_size + 224 + PCIMAX_DATA_OFFSET;
+	pcimax_plan_add(plan, key->bit, "AF0", buffer, 1);  /* number of defined AFs */
+	for (uint8_t i = 1; i <= 7;  i++) {
+		char af;
+		/* set all defined AFs to the desired frequency and the
+		 * rest to 0 */
+		sprintf(buffer, "AF%u", i);
+		if (i > settings->af_size) {
+			pcimax_plan_add(plan, key->bit, buffer, "0", 1);
+			continue;
+		}
+		pcimax_note(plan, "Setting %s to %0.1f\n", buffer,
+			settings->af[i-1] / 1000.0f);
+		af = pcimax_get_af_code(settings->af[i-1]);
+		pcimax_plan_add(plan, key->bit, buffer, &af, 1);
+	}
+}
+
+/* country code, value range 1..5 + offset */
+static void pcimax_encode_ecc(struct pcimax_plan *plan,
+			      const struct pcimax_values *settings,
+			      const struct pcimax_key *key)
+{
+	char ecc = settings->ecc + PCIMAX_DATA_OFFSET;
+
+	pcimax_note(plan, "Setting RDS ECC code to E%u\n", settings->ecc - 1);
+	pcimax_plan_add(plan, key->bit, key->cmd, &ecc, 1);
+}
+
+/* a) when setting a new RT the old value is not flushed but over-
+ * written. If the new RT is shorter than the old one, parts of
+ * the old RT will still be transmitted. To solve this problem the
+ * buffer is filled with space characters before setting the new RT
+ * b) RDS standard features an RDS RT a/b flag to notify the receiver
+ * the receiver that new RT will be transmitted. Pcimax3000+ does not
+ * support this */
+static void pcimax_encode_rt(struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     const struct pcimax_key *key)
+{
+	char buffer[64];
+
+	pcimax_note(plan, "Setting RDS RT to: %s\n", settings->rt);
+	/* overwrite the old RT with space characters */
+	memset(buffer, 0x20, 64);
+	pcimax_plan_add(plan, key->bit, key->cmd, buffer, 64);
+	pcimax_plan_add(plan, key->bit, key->cmd, settings->rt, strlen(settings->rt));
+}
+
+/* Even though pcimax3000+ features dynamic station names this
+ * program only supports static station naming, as the the RDS
+ * standard specifically states that the PS feature shouldn't
+ * be used dynamically */
+static void pcimax_encode_ps(struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     const struct pcimax_key *key)
+{
+	char buffer[8];
+
+	pcimax_note(plan, "Setting RDS PS to: %s\n", settings->ps);
+	/* overwrite the old PS with space characters */
+	memset(buffer, 0x20, 8);
+	pcimax_plan_add(plan, key->bit, key->cmd, buffer, 8);
+	/* a shorter name is padded, the null bytes would end the
+	 * command early */
+	memcpy(buffer, settings->ps, 8);
+	pcimax_replace_terminating_null(buffer, ' ', 8);
+	pcimax_plan_add(plan, key->bit, key->cmd, buffer, 8);
+}
+
+/* location of a value in struct pcimax_values */
+#define PCIMAX_VALUE(field) \
+	.offset = offsetof(struct pcimax_values, field), \
+	.size = sizeof(((struct pcimax_values *)0)->field)
+
+/* all settings, in the order of the config file sections, the commands
+ * are generated in this order too */
+const struct pcimax_key pcimax_keys[] = {
+	{ .section = "FM", .name = "freq", .bit = PCIMAX_FREQ,
+	  .cmd = "FF", PCIMAX_VALUE(freq),
+	  .parse = pcimax_parse_freq, .format = pcimax_format_freq,
+	  .encode = pcimax_encode_freq,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_URGENT,
+	  .cls = PCIMAX_CLASS_TUNE, .probe = true, .opt = 'f',
+	  .arg = "<freq>",
+	  .help = "set the frequency for the FM transmitter" },
+	{ .section = "FM", .name = "stereo", .bit = PCIMAX_STEREO,
+	  .cmd = "FS", PCIMAX_VALUE(is_stereo),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .encode = pcimax_encode_stereo,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_URGENT,
+	  .cls = PCIMAX_CLASS_TUNE,
+	  .arg = "<true/false>",
+	  .help = "set the transmitter into stereo / mono mode\n"
+		  "default = true => stereo\n"
+		  "!doesn't seem to have any effect" },
+	{ .section = "FM", .name = "power", .bit = PCIMAX_PWR,
+	  .cmd = "FO", PCIMAX_VALUE(power),
+	  .parse = pcimax_parse_power, .format = pcimax_format_power,
+	  .encode = pcimax_encode_power,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_URGENT,
+	  .cls = PCIMAX_CLASS_TUNE, .probe = true,
+	  .arg = "<0..100>",
+	  .help = "set the transmitter output power\n"
+		  "valid range: 0 .. 100" },
+	{ .section = "RDS", .name = "pi", .bit = PCIMAX_PI,
+	  PCIMAX_VALUE(pi),
+	  .parse = pcimax_parse_pi, .format = pcimax_format_pi,
+	  .encode = pcimax_encode_pi,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_HIGH,
+	  .cls = PCIMAX_CLASS_FLAG,
+	  .arg = "<pi code>",
+	  .help = "set the Program Identification code\n"
+		  "<pi code>: 0x0000 .. 0xFFFF or\n"
+		  "           0 .. 65535" },
+	{ .section = "RDS", .name = "pty", .bit = PCIMAX_PTY,
+	  .cmd = "PTY", PCIMAX_VALUE(pty),
+	  .parse = pcimax_parse_text, .format = pcimax_format_text,
+	  .encode = pcimax_encode_pty,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG,
+	  .arg = "<pty code>",
+	  .help = "set the Program Type Code\n"
+		  "<pty code> 0..31" },
+	{ .section = "RDS", .name = "ps", .bit = PCIMAX_PS,
+	  .cmd = "PS00", PCIMAX_VALUE(ps),
+	  .parse = pcimax_parse_ps, .format = pcimax_format_text,
+	  .encode = pcimax_encode_ps,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_HIGH,
+	  .cls = PCIMAX_CLASS_PS, .probe = true,
+	  .arg = "<station_name>",
+	  .help = "set the Program Station Name\n"
+		  "length is limited to 8 chars" },
+	{ .section = "RDS", .name = "rt", .bit = PCIMAX_RT,
+	  .cmd = "RT", PCIMAX_VALUE(rt),
+	  .parse = pcimax_parse_text, .format = pcimax_format_text,
+	  .encode = pcimax_encode_rt,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_TEXT, .probe = true,
+	  .arg = "<radio_text>",
+	  .help = "set the Radio Text\n"
+		  "length is limited to 64 chars" },
+	{ .section = "RDS", .name = "ecc", .bit = PCIMAX_ECC,
+	  .cmd = "ECC", PCIMAX_VALUE(ecc),
+	  .parse = pcimax_parse_ecc, .format = pcimax_format_ecc,
+	  .encode = pcimax_encode_ecc,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG,
+	  .arg = "<ecc>",
+	  .help = "set the Extended country code\n"
+		  "<ecc> 0..4 or e0..e4 or E0..E4" },
+	{ .section = "RDS", .name = "tp", .bit = PCIMAX_TP,
+	  .cmd = "TP", PCIMAX_VALUE(tp),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .encode = pcimax_encode_flag,
+	  .priority = PCIMAX_PRIO_URGENT, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG, .probe = true,
+	  .arg = "<true/false>",
+	  .help = "set the Traffic Program flag" },
+	{ .section = "RDS", .name = "ta", .bit = PCIMAX_TA,
+	  .cmd = "TA", PCIMAX_VALUE(ta),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .encode = pcimax_encode_flag,
+	  .priority = PCIMAX_PRIO_URGENT, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG, .probe = true,
+	  .arg = "<true/false>",
+	  .help = "set the Traffic Anouncement flag" },
+	{ .section = "RDS", .name = "ms", .bit = PCIMAX_MS,
+	  .cmd = "MS", PCIMAX_VALUE(ms),
+	  .parse = pcimax_parse_ms, .format = pcimax_format_ms,
+	  .encode = pcimax_encode_flag,
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG, .probe = true,
+	  .arg = "<true/false>",
+	  .help = "set the Music/Speech flag\n"
+		  "<true> -> music, <false> -> speech" },
+	/* the list and its size are one value */
+	{ .section = "RDS", .name = "af", .bit = PCIMAX_AF,
+	  .offset = offsetof(struct pcimax_values, af),
+	  .size = offsetof(struct pcimax_values, af_size) + sizeof(uint8_t) -
+		  offsetof(struct pcimax_values, af),
+	  .parse = pcimax_parse_af, .format = pcimax_format_af,
+	  .encode = pcimax_encode_af,
+	  .priority = PCIMAX_PRIO_BACKGROUND, .replay = PCIMAX_PRIO_BACKGROUND,
+	  .cls = PCIMAX_CLASS_FLAG,
+	  .arg = "<af list>",
+	  .help = "set the alternative frequencies for the station\n"
+		  "<af list>: e.g. 88.9,101.2\n"
+		  "max size of af list: 7" },
+	/* the decoder information flags are sent together, by the
+	 * encoder of the first one */
+	{ .section = "RDS", .name = "di_artificial", .bit = PCIMAX_DI,
+	  PCIMAX_VALUE(di_artificial),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .encode = pcimax_encode_di,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG },
+	{ .section = "RDS", .name = "di_compression", .bit = PCIMAX_DI,
+	  PCIMAX_VALUE(di_compression),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG },
+	{ .section = "RDS", .name = "di_dynamic_pty", .bit = PCIMAX_DI,
+	  PCIMAX_VALUE(di_dynamic_pty),
+	  .parse = pcimax_parse_flag, .format = pcimax_format_flag,
+	  .priority = PCIMAX_PRIO_NORMAL, .replay = PCIMAX_PRIO_NORMAL,
+	  .cls = PCIMAX_CLASS_FLAG },
+	{ .name = NULL }
+};
+
+/* commands of the groups of settings, see pcimax_plan_fm / pcimax_plan_rds */
+const struct pcimax_key pcimax_group_keys[] = {
+	{ .section = "FM", .name = "fm", .bit = PCIMAX_FM, .cmd = "FW",
+	  .priority = PCIMAX_PRIO_HIGH, .replay = PCIMAX_PRIO_URGENT,
+	  .cls = PCIMAX_CLASS_TUNE },
+	{ .section = "RDS", .name = "rds", .bit = PCIMAX_RDS, .cmd = "PWR",
+	  .priority = PCIMAX_PRIO_URGENT, .replay = PCIMAX_PRIO_URGENT,
+	  .cls = PCIMAX_CLASS_FLAG },
+	{ .section = "RDS", .name = "ps_slots", .bit = PCIMAX_PS_SLOTS,
+	  .priority = PCIMAX_PRIO_BACKGROUND, .replay = PCIMAX_PRIO_BACKGROUND,
+	  .cls = PCIMAX_CLASS_PS },
+	{ .name = NULL }
+};
+
+#define PCIMAX_KEY_COUNT	(sizeof(pcimax_keys) / sizeof(pcimax_keys[0]) - 1)
+/* size of the hash table of the settings, a power of two with room to
+ * spare, so that every probe sequence ends at an empty slot */
+#define PCIMAX_KEY_SLOTS	32
+
+/* FNV-1a hash of a setting name */
+static uint32_t pcimax_key_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* hash table of the settings, filled once when the library is loaded, so
+ * that the lookups need no locking */
+static const struct pcimax_key *pcimax_key_slots[PCIMAX_KEY_SLOTS];
+
+/* builds the hash table as a constructor, when the library is loaded and
+ * not on the first lookup, collisions go into the next free slot */
+__attribute__((constructor))
+static void pcimax_key_index(void)
+{
+	const struct pcimax_key *key;
+	uint32_t slot;
+
+	for (key = pcimax_keys; key->name; key++) {
+		slot = pcimax_key_hash(key->name);
+		while (pcimax_key_slots[slot % PCIMAX_KEY_SLOTS])
+			slot++;
+		pcimax_key_slots[slot % PCIMAX_KEY_SLOTS] = key;
+	}
+}
+
+/* looks up a setting by its name, every line of the config file, every
+ * request of the daemon and every feed line goes through here
+ * @ret_val:	NULL if there is no setting with this name */
+const struct pcimax_key *pcimax_find_key(const char *name)
+{
+	const struct pcimax_key *key;
+	uint32_t slot;
+
+	for (slot = pcimax_key_hash(name); pcimax_key_slots[slot % PCIMAX_KEY_SLOTS]; slot++) {
+		key = pcimax_key_slots[slot % PCIMAX_KEY_SLOTS];
+		if (strcmp(key->name, name) == 0)
+			return key;
+	}
+	return NULL;
+}
+
+/* looks up the setting a command belongs to, by its PCIMAX_* bit
+ * @ret_val:	NULL if there is none */
+const struct pcimax_key *pcimax_field_key(uint32_t field)
+{
+	const struct pcimax_key *key;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (key->bit == field)
+			return key;
+	}
+	for (key = pcimax_group_keys; key->name; key++) {
+		if (key->bit == field)
+			return key;
+	}
+	return NULL;
+}
+
+/* adds the commands of the settings in @mask to a plan */
+static void pcimax_encode_keys(struct pcimax_plan *plan,
+			       const struct pcimax_values *settings,
+			       uint32_t mask)
+{
+	const struct pcimax_key *key;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (key->encode && (mask & key->bit))
+			key->encode(plan, settings, key);
+	}
+}
+
+/* Updates / Sets the FM Transmitter related settings
+ * Frequency, Output Power and Stero/Mono mode
+ * @mask:	bitmask of the settings that will be sent to the card */
+void pcimax_plan_fm(struct pcimax_plan *plan,
+		    const struct pcimax_values *settings, uint32_t mask)
+{
+	/* nothing FM related to update -> no need to commit */
+	if (!(mask & PCIMAX_FM_FIELDS))
+		return;
+	pcimax_encode_keys(plan, settings, mask & PCIMAX_FM_FIELDS);
+	/* store the settings, commit changes */
+	pcimax_plan_add(plan, PCIMAX_FM, "FW", "0", 1);
+}
+
+/* Updates / Sets RDS related settings
+ * @mask:	bitmask of the settings that will be sent to the card, the
+ *		PCIMAX_RDS bit requests (re)enabling the RDS output */
+void pcimax_plan_rds(struct pcimax_plan *plan,
+		     const struct pcimax_values *settings, uint32_t mask)
+{
+	char buffer[5];
+
+	/* enable RDS output */
+	if (mask & PCIMAX_RDS)
+		pcimax_plan_add(plan, PCIMAX_RDS, "PWR", "1", 1);
+
+	pcimax_encode_keys(plan, settings, mask & ~PCIMAX_FM_FIELDS);
+
+	/* clearing the slots for dynamic PS, only necessary when the card
+	 * state of the slots is not known */
+	if (mask & PCIMAX_PS_SLOTS) {
+		for (uint8_t i = 1; i < 40; i++) {
+			sprintf(buffer, "PS%02u", i);
+			pcimax_plan_add(plan, PCIMAX_PS_SLOTS, buffer, "NULL", 4);
+		}
+		/* setting the delays for dynamic PS (disabeling the dynamic PS feature)
+		 * there are 40 fields available, all of them have to be set */
+		pcimax_plan_add(plan, PCIMAX_PS_SLOTS, "PD00", "1", 1);
+		for (uint8_t i = 1; i < 40; i++) {
+			sprintf(buffer, "PD%02u", i);
+			pcimax_plan_add(plan, PCIMAX_PS_SLOTS, buffer, "0", 1);
+		}
+	}
+}
+
+/* compares the card related fields of two settings structs
+ * @old:	settings that were last applied to the card
+ * @new:	freshly parsed settings
+ * @ret_val:	bitmask of the fields defined in @new that differ from @old,
+ *		the PCIMAX_FM / PCIMAX_RDS group bits are set when the group
+ *		wasn't defined in @old */
+uint32_t pcimax_values_diff(const struct pcimax_values *old,
+			    const struct pcimax_values *new)
+{
+	const struct pcimax_key *key;
+	uint32_t changed = 0;
+
+	/* fields that were not defined before are always sent */
+	changed |= new->defined & ~old->defined;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (memcmp((const char *)old + key->offset,
+			   (const char *)new + key->offset, key->size))
+			changed |= key->bit;
+	}
+	/* the mono/stereo flag is part of the decoder information */
+	if (changed & PCIMAX_STEREO)
+		changed |= PCIMAX_DI;
+
+	/* only report fields that are actually defined */
+	changed &= new->defined;
+	/* the group bits (RDS enable) are only set for new groups */
+	changed &= ~(old->defined & (PCIMAX_FM | PCIMAX_RDS));
+
+	return changed;
+}
+
+/* copies the card related fields selected by @mask from @src to @dst */
+void pcimax_values_copy(struct pcimax_values *dst,
+			const struct pcimax_values *src, uint32_t mask)
+{
+	const struct pcimax_key *key;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (mask & key->bit)
+			memcpy((char *)dst + key->offset,
+			       (const char *)src + key->offset, key->size);
+	}
+}
+
+/* @ret_val:	true if the card related fields selected by @mask have the
+ *		same values in @a and @b */
+bool pcimax_values_equal(const struct pcimax_values *a,
+			 const struct pcimax_values *b, uint32_t mask)
+{
+	const struct pcimax_key *key;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if ((mask & key->bit) &&
+		    memcmp((const char *)a + key->offset,
+			   (const char *)b + key->offset, key->size))
+			return false;
+	}
+	return true;
+}
+
+/* @len:	set to the number of data bytes of the frame
+ * @ret_val:	data of the frame */
+const char *pcimax_frame_data(const struct pcimax_frame *frame, size_t *len)
+{
+	/* 0x00 <cmd> 0x01 <data> 0x02 */
+	const char *data = memchr(frame->buf + 1, 0x01, frame->len - 1);
+
+	data++;
+	*len = frame->buf + frame->len - 1 - data;
+	return data;
+}
+
+/* inverse of the offset that is added to numeric data
+ * @ret_val:	-1 if the byte is out of range */
+static int pcimax_decode_byte(char value)
+{
+	return ((uint8_t)value < PCIMAX_DATA_OFFSET) ? -1 :
+	       (uint8_t)value - PCIMAX_DATA_OFFSET;
+}
+
+/* describes the value a frame carries, decoded the way the card reads it,
+ * e.g. "103.50 MHz" for FF
+ * @buf:	buffer of PCIMAX_VALUE_MAX bytes */
+void pcimax_frame_describe(const struct pcimax_frame *frame, char *buf)
+{
+	char cmd[PCIMAX_CMD_MAX + 1];
+	const char *data;
+	size_t len;
+	int value;
+
+	pcimax_frame_cmd(frame, cmd);
+	data = pcimax_frame_data(frame, &len);
+	value = len ? pcimax_decode_byte(data[0]) : -1;
+
+	if (strcmp(cmd, "FF") == 0 && len == 2) {
+		/* low byte, high byte, 7 bits each, in 5kHz steps */
+		sprintf(buf, "%.2f MHz", (pcimax_decode_byte(data[1]) * 128 +
+					  value) * 5 / 1000.0f);
+	} else if (strcmp(cmd, "FO") == 0) {
+		sprintf(buf, "power level %d/21", value);
+	} else if (strcmp(cmd, "FS") == 0 || strcmp(cmd, "Did0") == 0) {
+		strcpy(buf, data[0] == '1' ? "stereo" : "mono");
+	} else if (strcmp(cmd, "FW") == 0) {
+		strcpy(buf, "store the FM settings");
+	} else if (strcmp(cmd, "PWR") == 0) {
+		strcpy(buf, "RDS output on");
+	} else if (strcmp(cmd, "CCAC") == 0 || strcmp(cmd, "PREF") == 0) {
+		sprintf(buf, "PI %s byte 0x%02lx",
+			cmd[0] == 'C' ? "country / coverage" : "program reference",
+			strtoul(data, NULL, 10) & 0xff);
+	} else if (strcmp(cmd, "MS") == 0) {
+		strcpy(buf, data[0] == '1' ? "music" : "speech");
+	} else if (strcmp(cmd, "AF0") == 0) {
+		sprintf(buf, "%d alternative frequencies", value - 224);
+	} else if (strncmp(cmd, "AF", 2) == 0) {
+		if (data[0] == '0')
+			strcpy(buf, "unused");
+		else
+			sprintf(buf, "%.1f MHz", (87500 + value * 100) / 1000.0f);
+	} else if (strcmp(cmd, "ECC") == 0) {
+		sprintf(buf, "E%d", value - 1);
+	} else if (strcmp(cmd, "PTY") == 0) {
+		sprintf(buf, "%.*s", (int)len, data);
+	} else if (strncmp(cmd, "PD", 2) == 0) {
+		sprintf(buf, "dynamic PS slot %.2s delay %.*s", cmd + 2,
+			(int)len, data);
+	} else if (strncmp(cmd, "PS", 2) == 0 && len == 4 &&
+		   memcmp(data, "NULL", 4) == 0) {
+		sprintf(buf, "clear dynamic PS slot %.2s", cmd + 2);
+	} else if (strcmp(cmd, "RT") == 0 || strncmp(cmd, "PS", 2) == 0) {
+		sprintf(buf, "\"%.*s\"", (int)len, data);
+	} else if (len == 1 && (data[0] == '0' || data[0] == '1')) {
+		/* TP, TA, the decoder information */
+		strcpy(buf, data[0] == '1' ? "on" : "off");
+	} else {
+		sprintf(buf, "%zu bytes", len);
+	}
+}
+
+/* @ret_val:	true if the AF / DI slot written by @cmd already holds the
+ *		value of @settings on the card */
+static bool pcimax_slot_known(const char *cmd,
+			      const struct pcimax_values *settings,
+			      const struct pcimax_values *known)
+{
+	int slot;
+
+	if (strncmp(cmd, "AF", 2) == 0 && (known->defined & PCIMAX_AF)) {
+		slot = cmd[2] - '0';
+		if (slot == 0)
+			return known->af_size == settings->af_size;
+		/* unused slots are cleared */
+		return (slot <= known->af_size ? known->af[slot - 1] : 0) ==
+		       (slot <= settings->af_size ? settings->af[slot - 1] : 0);
+	}
+	if (strncmp(cmd, "Did", 3) == 0 && (known->defined & PCIMAX_DI)) {
+		switch (cmd[3]) {
+		case '0':
+			return (known->defined & PCIMAX_STEREO) &&
+			       known->is_stereo == settings->is_stereo;
+		case '1':
+			return known->di_artificial == settings->di_artificial;
+		case '2':
+			return known->di_compression == settings->di_compression;
+		case '3':
+			return known->di_dynamic_pty == settings->di_dynamic_pty;
+		}
+	}
+	return false;
+}
+
+/* removes the commands of a plan that don't change anything on the card:
+ * - writes that a later write of the same command overwrites. A shorter
+ *   later write of a text (RT, PS) takes over the rest of the earlier one,
+ *   so clearing the old text and writing the new one is a single write of
+ *   the padded text
+ * - AF and DI slots that already hold the value
+ * - the FM commit, if no FM setting is written
+ * @settings:	settings the plan was generated from
+ * @known:	settings the card is known to have (the defined ones), NULL
+ *		if the card state is unknown */
+void pcimax_plan_optimize(struct pcimax_plan *plan,
+			  const struct pcimax_values *settings,
+			  const struct pcimax_values *known)
+{
+	char cmd[PCIMAX_CMD_MAX + 1];
+	char later_cmd[PCIMAX_CMD_MAX + 1];
+	char data[PCIMAX_DATA_MAX];
+	const char *old_data;
+	const char *new_data;
+	size_t old_len, new_len;
+	struct pcimax_frame *frame;
+	bool fm_written = false;
+	size_t kept = 0;
+	size_t count;
+
+	for (size_t i = 0; i < plan->count; i++) {
+		frame = &plan->frames[i];
+		pcimax_frame_cmd(frame, cmd);
+		if (known && pcimax_slot_known(cmd, settings, known)) {
+			frame->field = 0;
+			continue;
+		}
+		for (size_t j = i + 1; j < plan->count; j++) {
+			pcimax_frame_cmd(&plan->frames[j], later_cmd);
+			if (!plan->frames[j].field || strcmp(cmd, later_cmd))
+				continue;
+			old_data = pcimax_frame_data(frame, &old_len);
+			new_data = pcimax_frame_data(&plan->frames[j], &new_len);
+			if (new_len < old_len) {
+				if (!(frame->field & (PCIMAX_RT | PCIMAX_PS)))
+					break;
+				memcpy(data, new_data, new_len);
+				memcpy(data + new_len, old_data + new_len,
+				       old_len - new_len);
+				/* rebuilds the later frame in place */
+				count = plan->count;
+				plan->count = j;
+				pcimax_plan_add(plan, frame->field, cmd, data, old_len);
+				plan->count = count;
+			}
+			frame->field = 0;
+			break;
+		}
+		if (frame->field & PCIMAX_FM_FIELDS)
+			fm_written = true;
+	}
+	for (size_t i = 0; i < plan->count; i++) {
+		frame = &plan->frames[i];
+		if (frame->field == PCIMAX_FM && !fm_written)
+			continue;
+		if (frame->field)
+			plan->frames[kept++] = *frame;
+	}
+	plan->count = kept;
+}
+
+/* opens the card at @device and sets up its serial line
+ * @handle:	set to the handle of the card
+ * @ret_val:	0, negative errno value on error */
+int pcimax_open(const char *device, struct pcimax **handle)
+{
+	struct pcimax *card;
+	int fd;
+
+	card = calloc(1, sizeof(*card));
+	if (!card)
+		return -ENOMEM;
+	fd = pcimax_serial_open(device, &card->old_settings);
+	if (fd < 0) {
+		free(card);
+		return fd;
+	}
+	card->fd = fd;
+	card->delay = PCIMAX_DEFAULT_DELAY;
+	/* the decoder information flags are sent together, the ones that
+	 * were never set go out with the defaults of the card */
+	card->values.is_stereo = '1';
+	card->values.di_artificial = '0';
+	card->values.di_compression = '0';
+	card->values.di_dynamic_pty = '0';
+	*handle = card;
+	return 0;
+}
+
+/* restores the serial line setup and closes the card */
+void pcimax_close(struct pcimax *handle)
+{
+	if (!handle)
+		return;
+	pcimax_serial_close(handle->fd, &handle->old_settings);
+	free(handle);
+}
+
+void pcimax_set_delay(struct pcimax *handle, uint32_t ms)
+{
+	handle->delay = ms;
+}
+
+/* sends the commands of a plan one by one, every command gets the time
+ * the card needs to process it
+ * @ret_val:	0, negative errno value on error */
+static int pcimax_send(struct pcimax *handle, const struct pcimax_plan *plan)
+{
+	int64_t start;
+	int ret;
+
+	for (size_t i = 0; i < plan->count; i++) {
+		/* discard stale input, so that only the answer to this
+		 * command releases the next one */
+		tcflush(handle->fd, TCIFLUSH);
+		start = pcimax_now_ms();
+		ret = pcimax_frame_write(handle->fd, &plan->frames[i]);
+		if (ret < 0)
+			return ret;
+		pcimax_answer_wait(handle->fd, start + handle->delay);
+	}
+	return 0;
+}
+
+/* sends the defined values of @settings that the card doesn't have yet
+ * @ret_val:	0, negative errno value on error */
+int pcimax_apply(struct pcimax *handle, const struct pcimax_values *settings)
+{
+	struct pcimax_values next = handle->values;
+	struct pcimax_plan plan;
+	uint32_t changed;
+	int ret;
+
+	/* the values of the settings that aren't defined stay */
+	pcimax_values_copy(&next, settings, settings->defined);
+	next.defined |= settings->defined;
+	changed = pcimax_values_diff(&handle->values, &next);
+	if (!changed)
+		return 0;
+	pcimax_plan_init(&plan, NULL);
+	pcimax_plan_fm(&plan, &next, changed);
+	pcimax_plan_rds(&plan, &next, changed);
+	pcimax_plan_optimize(&plan, &next, &handle->values);
+	ret = pcimax_send(handle, &plan);
+	/* after an error the state of the card is unknown */
+	if (ret < 0)
+		handle->values.defined = 0;
+	else
+		handle->values = next;
+	return ret;
+}
+
+/* parses and sends a single setting
+ * @ret_val:	0, -EINVAL if there is no setting @name or @value is
+ *		invalid, negative errno value on error */
+int pcimax_set(struct pcimax *handle, const char *name, const char *value)
+{
+	const struct pcimax_key *key = pcimax_find_key(name);
+	struct pcimax_values settings;
+
+	if (!key)
+		return -EINVAL;
+	/* settings that share a field (the DI flags) keep what the card has */
+	settings = handle->values;
+	settings.defined = 0;
+	if (!key->parse(&settings, key, value))
+		return -EINVAL;
+	return pcimax_apply(handle, &settings);
+}
+
+/* current value of a setting, as it is accepted by pcimax_set
+ * @buf:	buffer of PCIMAX_VALUE_MAX bytes
+ * @ret_val:	0, -EINVAL if there is no setting @name, -ENOENT if the card
+ *		didn't get a value yet */
+int pcimax_get(const struct pcimax *handle, const char *name, char *buf)
+{
+	const struct pcimax_key *key = pcimax_find_key(name);
+
+	if (!key)
+		return -EINVAL;
+	if (!(handle->values.defined & key->bit))
+		return -ENOENT;
+	key->format(&handle->values, key, buf);
+	return 0;
+}
+
+/* @ret_val:	settings the card got through the handle */
+const struct pcimax_values *pcimax_get_values(const struct pcimax *handle)
+{
+	return &handle->values;
+}
@@ -21,8 +21,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <sys/ioctl.h>
+#include <stddef.h>
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <limits.h>
 #include <string.h>	/* String function definitions */
 #include <unistd.h>	/* UNIX standard function definitions */
@@ -34,70 +43,93 @@
 #include <time.h>
 #include <libudev.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include "include/inih/ini.h"	/* ini file parsing lib */
+#include "pcimax.h"
 
-/* define bits for bitmask that defines the settings that the user wants
- * to update */
-#define PCIMAX_FM	0x01	/* FM related setting change requested */
-#define PCIMAX_RDS	0x02	/* RDS related setting change requested */
-#define PCIMAX_FREQ	0x10
-#define PCIMAX_PWR	0x20
-#define PCIMAX_STEREO	0x40
-#define PCIMAX_AF	0x80
-#define PCIMAX_RT	0x100
-#define PCIMAX_PI	0x200
-#define PCIMAX_PTY	0x400
-#define PCIMAX_PTYT	0x800
-#define PCIMAX_TP	0x1000
-#define PCIMAX_TA	0x2000
-#define PCIMAX_MS	0x4000
-#define PCIMAX_PS	0x8000
-#define PCIMAX_ECC	0x10000
-#define PCIMAX_DI	0x20000
-
-static struct termios old_settings;
-static int fd = -1;
+/* time the config file has to be left alone before a modification is
+ * applied, editors and deployment tools often save in several steps */
+#define PCIMAX_DEFAULT_DEBOUNCE	300
+/* calibration: every trial sends the commands of a class this many times,
+ * the search ends when the delay is known to this precision (ms) */
+#define PCIMAX_CALIBRATE_REPEAT	5
+#define PCIMAX_CALIBRATE_STEP	2
+
+/* location of the files recording the last committed state of each card */
+#define PCIMAX_STATE_DIR	"/var/lib/pcimax-ctl"
+#define PCIMAX_STATE_MAGIC	0x584d4350	/* "PCMX" */
+#define PCIMAX_STATE_VERSION	1
+#define PCIMAX_JOURNAL_MAGIC	0x4e524a50	/* "PJRN" */
+#define PCIMAX_JOURNAL_VERSION	1
+#define PCIMAX_KEY_MAX		80
+/* control socket of the daemon */
+#define PCIMAX_SOCKET		"/run/pcimax-ctl.sock"
+/* longest line of the control protocol, "set rt=<64 chars>" */
+#define PCIMAX_LINE_MAX		256
+/* max number of values a client can set before they are applied */
+#define PCIMAX_STAGED_MAX	32
+
+/* max number of cards that are controlled by one process */
+#define PCIMAX_CARD_MAX		8
+/* the auto-detected cards are cached by their /dev/serial/by-id names in
+ * the state directory */
+#define PCIMAX_CACHE_FILE	"devices.cache"
+
+static uint32_t cmd_delay = PCIMAX_DEFAULT_DELAY;
+static bool verbose;
 
 /* short options */
 enum Options{
 	OptSetDevice = 'd',
-	OptSetFreq = 'f',
 	OptHelp = 'h',
 	OptMonitor = 'm',
+	OptVerbose = 'v',
 	OptFile = 64,
-	OptSetAF,
-	OptSetECC,
-	OptSetMS,
-	OptSetPower,
-	OptSetPI,
-	OptSetPS,
-	OptSetPTY,
-	OptSetRT,
-	OptSetStereo,
-	OptSetTA,
-	OptSetTP,
-	OptLast = 128
+	OptDelay,
+	OptDebounce,
+	OptForce,
+	OptDryRun,
+	OptCalibrate,
+	OptVerify,
+	OptRescan,
+	OptStateDir,
+	OptDaemon,
+	OptSocket,
+	OptGet,
+	OptFeed,
+	OptMetrics,
+	OptProfile,
+	OptBatch,
+	/* --set-<name>, one per setting of pcimax_keys, in the same order */
+	OptSetKey = 128,
+	OptLast = 256
 };
 
 /* long options */
 static struct option long_options[] = {
+	{"batch", required_argument, 0, OptBatch},
+	{"calibrate", no_argument, 0, OptCalibrate},
+	{"daemon", no_argument, 0, OptDaemon},
+	{"debounce", required_argument, 0, OptDebounce},
+	{"delay", required_argument, 0, OptDelay},
 	{"device", required_argument, 0, OptSetDevice},
+	{"dry-run", no_argument, 0, OptDryRun},
+	{"feed", required_argument, 0, OptFeed},
 	{"file", required_argument, 0, OptFile},
+	{"force", no_argument, 0, OptForce},
+	{"get", required_argument, 0, OptGet},
 	{"help", no_argument, 0, OptHelp},
+	{"metrics", required_argument, 0, OptMetrics},
 	{"monitor", no_argument, 0, OptMonitor},
-	{"set-af", required_argument, 0, OptSetAF},
-	{"set-ecc", required_argument, 0, OptSetECC},
-	{"set-freq", required_argument, 0, OptSetFreq},
-	{"set-ms", required_argument, 0, OptSetMS},
-	{"set-power", required_argument, 0, OptSetPower},
-	{"set-pi", required_argument, 0 , OptSetPI},
-	{"set-ps", required_argument, 0, OptSetPS},
-	{"set-pty", required_argument, 0, OptSetPTY},
-	{"set-rt", required_argument, 0, OptSetRT},
-	{"set-stereo", required_argument, 0, OptSetStereo},
-	{"set-ta", required_argument, 0 , OptSetTA},
-	{"set-tp", required_argument, 0, OptSetTP},
+	{"profile", required_argument, 0, OptProfile},
+	{"rescan", no_argument, 0, OptRescan},
+	{"socket", required_argument, 0, OptSocket},
+	{"state-dir", required_argument, 0, OptStateDir},
+	{"verbose", no_argument, 0, OptVerbose},
+	{"verify", required_argument, 0, OptVerify},
 	{0, 0, 0, 0}
 };
 
@@ -108,32 +140,332 @@ struct pcimax_settings {
 	char options[OptLast];	/* array with 1 field (true/false) for each option */
 	char device[80];	/* path of the virtual com port of pcimax3000+ */
 	char file[80];		/* path of the config file */
+	uint32_t delay;		/* max delay after each command in ms */
+	uint32_t debounce;	/* quiet time before a config change is applied */
+	char state_dir[80];	/* directory holding the card state files */
+	char socket[80];	/* path of the daemon control socket */
+	char get[80];		/* name of the setting to query from the daemon */
+	char metrics[80];	/* path of the metrics file */
+	char profile[80];	/* profile to switch to */
+	char feed[80];		/* FIFO streaming RT updates, "-" for stdin */
+	char batch[80];		/* stream of setting transactions, "-" for stdin */
+	char verify[256];	/* command verifying a calibration trial */
 	bool monitor;		/* monitor config file for changes */
-	
-	/** FM-Transmitter settings **/
-	uint32_t freq;	/* range 87500..108000 */
-	uint8_t power; 	/* range 0..100 */
-	char is_stereo; 
-	
-	/** RDS settings **/
-	/* fields are stored as chars to ease transmission over serial line */
-	uint8_t pi[2];
-	uint32_t af[7];		/* Alternative Frequencies, range 87500..10800 */ 
-	uint8_t af_size;	/* number of defined AFs */
-	char rt[65];		/* Null-terminated string */
-	char pty[3];		/* Null-terminated string */
-	char ps[9];		/* Null-terminated string */
-	char ecc;		/* Extended country code */
-	char tp;		/* Traffic Program flag */
-	char ta;		/* Traffic Announcement flag */
-	char ms;		/* music / speech flag */
-	/* decoder information fields */
-	char di_artificial; 	/* artificial head */
-	char di_compression;	/* compressed transmission flag */
-	char di_dynamic_pty;	/* dynamic program type */
+
+	/** card settings **/
+	struct pcimax_values values;
+};
+
+/* content of the state file, memory-mapped while the program runs */
+struct pcimax_state {
+	uint32_t magic;		/* PCIMAX_STATE_MAGIC */
+	uint32_t version;	/* PCIMAX_STATE_VERSION */
+	uint32_t size;		/* size of the settings struct */
+	/* settings that were last committed to the card, the defined
+	 * bitmask denotes the fields whose state on the card is known */
+	struct pcimax_values committed;
+};
+
+static const char *pcimax_priority_names[PCIMAX_PRIO_COUNT] = {
+	"urgent", "high", "normal", "background"
+};
+
+static const char *pcimax_class_names[PCIMAX_CLASS_COUNT] = {
+	"flag", "tune", "text", "ps"
+};
+
+/* max number of commands waiting in each priority class */
+#define PCIMAX_QUEUE_MAX	PCIMAX_PLAN_MAX
+
+/* a command waiting to be sent */
+struct pcimax_queued {
+	struct pcimax_frame frame;
+	int64_t queued_ms;	/* time at which the command was queued */
+	uint32_t gen;		/* generation of its setting when it was queued */
+};
+
+/* FIFO of the commands of one priority class */
+struct pcimax_queue {
+	size_t head;
+	size_t count;
+	struct pcimax_queued entries[PCIMAX_QUEUE_MAX];
+};
+
+/* max number of commands that are written in one go (--delay=0) */
+#define PCIMAX_BATCH_MAX	(PCIMAX_PRIO_COUNT * PCIMAX_QUEUE_MAX)
+
+enum pcimax_sched_state {
+	PCIMAX_SCHED_IDLE,	/* ready to send the next command */
+	PCIMAX_SCHED_WRITING,	/* waiting for the serial line to accept data */
+	PCIMAX_SCHED_WAITING,	/* waiting for the card to process a command */
+};
+
+/* command scheduler, sends the queued commands by priority */
+struct pcimax_sched {
+	enum pcimax_sched_state state;
+	struct pcimax_queue queues[PCIMAX_PRIO_COUNT];
+	uint16_t pending[32];	/* queued commands per setting (bit number) */
+	/* generation of the queued commands per setting, bumped when they're
+	 * superseded, a command of an older generation that is still being
+	 * written doesn't count against the new ones */
+	uint32_t gen[32];
+	struct pcimax_values target;	/* values of the queued settings */
+	/* commands that are being written */
+	size_t batch_count;
+	struct pcimax_queued batch[PCIMAX_BATCH_MAX];
+	int batch_prio[PCIMAX_BATCH_MAX];
+	struct iovec iov[PCIMAX_BATCH_MAX];
+	struct iovec *iov_next;	/* first buffer that isn't written completely */
+	int iov_left;
+	int64_t cmd_start;	/* time at which the last command left the line */
+	uint32_t wait_max;	/* time the card gets to process it */
+	/* statistics of the current run */
+	int64_t run_start;
+	uint32_t sent;
+	int64_t max_delay;
+};
+
+/* max number of confirmed commands recorded in the journal */
+#define PCIMAX_JOURNAL_MAX	PCIMAX_BATCH_MAX
+
+/* content of the journal file, the progress of the settings that are
+ * being sent to a card, so that an interrupted update continues with the
+ * first command the card didn't confirm. Memory-mapped while the program
+ * runs */
+struct pcimax_journal {
+	uint32_t magic;		/* PCIMAX_JOURNAL_MAGIC */
+	uint32_t version;	/* PCIMAX_JOURNAL_VERSION */
+	uint32_t size;		/* size of the settings struct */
+	uint32_t fields;	/* settings whose commands are being sent */
+	struct pcimax_values target;	/* values of these settings */
+	uint32_t count;
+	struct {
+		uint32_t field;	/* PCIMAX_* bit of the command */
+		uint32_t hash;	/* FNV-1a hash of the frame */
+	} done[PCIMAX_JOURNAL_MAX];	/* commands the card confirmed */
+};
+
+/* upper bounds (ms) of the histogram buckets of the metrics, the last
+ * bucket (+Inf) is implicit */
+static const uint32_t pcimax_hist_bounds[] = {
+	5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+#define PCIMAX_HIST_BUCKETS	(sizeof(pcimax_hist_bounds) / sizeof(pcimax_hist_bounds[0]))
+
+/* distribution of durations, not cumulative */
+struct pcimax_hist {
+	uint64_t buckets[PCIMAX_HIST_BUCKETS + 1];
+	uint64_t count;
+	int64_t sum_ms;
+};
+
+/* distinct command mnemonics, PS00..PS39 and PD00..PD39 are the most */
+#define PCIMAX_METRIC_CMDS	128
+
+/* counters of a card since the program started */
+struct pcimax_metrics {
+	struct {
+		char cmd[PCIMAX_CMD_MAX + 1];
+		uint64_t count;
+	} cmds[PCIMAX_METRIC_CMDS];	/* commands sent per mnemonic */
+	size_t cmd_count;
+	uint64_t bytes;		/* bytes written to the serial line */
+	uint64_t write_errors;
+	uint64_t partial_writes;	/* the line didn't take all data at once */
+	int64_t write_us;	/* time spent writing commands */
+	int64_t wait_us;	/* time spent waiting for the card */
+	int64_t phase_us;	/* start of the current write / wait */
+	struct pcimax_hist queue_delay;	/* time the commands were queued */
+	struct pcimax_hist apply;	/* duration of the updates */
 };
 
-static void pcimax_set_settings(int fd, const struct termios *settings);
+/* fixed setups of the cards, [profile:<name>] sections of the config file
+ * on top of the [FM] / [RDS] sections */
+#define PCIMAX_PROFILE_MAX	8
+#define PCIMAX_PROFILE_NAME	32
+
+struct pcimax_profile {
+	char name[PCIMAX_PROFILE_NAME];
+	struct pcimax_values values;	/* settings of the section */
+};
+
+/* a profile compiled for a card, switching to it needs no parsing and no
+ * command generation */
+struct pcimax_card_profile {
+	struct pcimax_values settings;	/* card settings with the profile */
+	struct pcimax_plan plan;	/* commands of all these settings */
+};
+
+/* an entry of the [schedule] section: a setting that changes at a time of
+ * day or in an interval (counted from midnight) */
+#define PCIMAX_TIMETABLE_MAX	32
+
+struct pcimax_timetable_entry {
+	uint32_t at;		/* second of the day */
+	uint32_t every;		/* interval in s, 0 for a time of day */
+	struct pcimax_values values;	/* setting changed then */
+	time_t next;		/* next time the entry is due */
+};
+
+/* a pcimax3000+ card and everything needed to drive it, all cards are
+ * served by the main loop in parallel */
+struct pcimax_card {
+	char device[PATH_MAX];	/* path of the virtual com port */
+	char syspath[PATH_MAX];	/* sysfs path of the tty device */
+	char serial[PCIMAX_KEY_MAX];	/* USB serial, empty if unknown */
+	char link[PATH_MAX];	/* stable by-id name, empty if unknown */
+	char key[PCIMAX_KEY_MAX];	/* name of the state file */
+	int fd;			/* serial line, -1 if the card isn't usable */
+	int timer_fd;		/* pacing of the commands */
+	struct termios old_settings;	/* original setup of the port */
+	struct pcimax_state *shadow;	/* state file of the card */
+	struct pcimax_journal *journal;	/* progress of the current update */
+	struct pcimax_values settings;	/* settings applied to the card */
+	struct pcimax_sched sched;
+	/* status */
+	bool failed;
+	char error[128];	/* reason of the failure */
+	uint32_t total_sent;	/* commands sent since the program started */
+	int64_t busy_ms;	/* time spent sending them */
+	struct pcimax_metrics metrics;
+	/* calibrated delay per command class in ms, 0 if unknown */
+	uint32_t timing[PCIMAX_CLASS_COUNT];
+	uint32_t feed_staged;	/* feed values the card didn't get yet */
+	struct pcimax_card_profile profiles[PCIMAX_PROFILE_MAX];
+	char profile[PCIMAX_PROFILE_NAME];	/* active profile, "" if none */
+	/* next changes of the [schedule] section, compiled ahead of time on
+	 * top of the settings in timetable_base */
+	struct pcimax_card_profile timetable;
+	struct pcimax_values timetable_base;
+	int64_t ta_trigger_us;	/* time of a pending TA trigger (us), 0 if none */
+};
+
+/* sources of events in the main loop, stored in the lower 32 bits of the
+ * epoll event data, the upper 32 bits hold the index of the card / client */
+enum pcimax_source {
+	PCIMAX_SRC_SERIAL,
+	PCIMAX_SRC_TIMER,
+	PCIMAX_SRC_SIGNAL,
+	PCIMAX_SRC_NOTIFY,
+	PCIMAX_SRC_DEBOUNCE,
+	PCIMAX_SRC_LISTEN,
+	PCIMAX_SRC_CLIENT,
+	PCIMAX_SRC_HOTPLUG,
+	PCIMAX_SRC_FEED,
+	PCIMAX_SRC_BATCH,
+	PCIMAX_SRC_TIMETABLE,
+};
+
+/* values a client of the control socket has set, but not applied yet */
+struct pcimax_staged {
+	size_t count;
+	struct {
+		const struct pcimax_key *key;
+		char value[PCIMAX_LINE_MAX];
+	} entries[PCIMAX_STAGED_MAX];
+};
+
+/* a connection to the control socket */
+#define PCIMAX_CLIENT_MAX	8
+struct pcimax_client {
+	int fd;			/* -1 if the slot is unused */
+	size_t len;		/* bytes of an incomplete request in buf */
+	char buf[PCIMAX_LINE_MAX];
+	int card;		/* card addressed by requests, -1: all cards */
+	struct pcimax_staged staged;
+};
+
+/* RT / PTY / MS updates streamed line by line (--feed) */
+struct pcimax_feed {
+	int fd;			/* -1 if unused */
+	bool file;		/* regular file, read whenever the cards are idle */
+	size_t len;		/* bytes of an incomplete line in buf */
+	char buf[PCIMAX_LINE_MAX];
+	struct pcimax_values values;	/* newest value of each setting */
+};
+
+/* transactions of settings streamed line by line (--batch) */
+struct pcimax_batch {
+	int fd;			/* -1 if unused */
+	bool file;		/* regular file, read whenever the cards are idle */
+	size_t len;		/* bytes of an incomplete line in buf */
+	char buf[PCIMAX_LINE_MAX];
+	unsigned int line;	/* number of the last line, for the messages */
+	char section[64];	/* section of an ini fragment, "" if none */
+	int card;		/* card addressed by a [card:<id>] section, -1: all */
+	bool skip;		/* the lines belong to an unknown section */
+	bool dropped;		/* the current line was too long, skip its rest */
+	struct pcimax_staged staged;	/* values of the open transaction */
+};
+
+/* main loop, everything the program waits for is an event of the loop:
+ * answers of the cards, the serial lines accepting data, the pacing timers,
+ * signals, modifications of the config file and control socket requests */
+struct pcimax_loop {
+	int epoll_fd;
+	int signal_fd;		/* SIGINT, SIGTERM, SIGHUP, TA, profile switches */
+	int notify_fd;		/* config file modifications, -1 if unused */
+	int debounce_fd;	/* delays the reload after a modification */
+	uint32_t debounce;	/* debounce time in ms */
+	char watch_name[80];	/* name of the config file in the watched dir */
+	int listen_fd;		/* control socket, -1 if unused */
+	struct udev *udev;
+	struct udev_monitor *hotplug;	/* cards leaving / returning */
+	bool persistent;	/* keep running when all commands are sent */
+	bool stop;		/* terminate as soon as possible */
+	/* settings from the command line and the config file */
+	struct pcimax_settings *settings;
+	/* values of the last (re)load of the config file, cards that are
+	 * plugged in later start from them */
+	struct pcimax_values base;
+	struct pcimax_client clients[PCIMAX_CLIENT_MAX];
+	struct pcimax_feed feed;
+	struct pcimax_batch batch;
+	uint64_t reloads;	/* config file reloads */
+	struct pcimax_profile profiles[PCIMAX_PROFILE_MAX];
+	size_t profile_count;
+	char profile[PCIMAX_PROFILE_NAME];	/* of all cards, "" if none */
+	struct pcimax_timetable_entry timetable[PCIMAX_TIMETABLE_MAX];
+	size_t timetable_count;
+	int timetable_fd;	/* expires at the next entry, -1 if unused */
+	time_t timetable_due;	/* time of the next entries, 0 if none */
+	struct pcimax_values timetable_values;	/* settings changed then */
+	struct pcimax_frame ta_frames[2];	/* TA off / on, for the triggers */
+	char ta_override;	/* TA value of the last trigger, 0 if none */
+};
+
+static struct pcimax_card cards[PCIMAX_CARD_MAX];
+static size_t card_count;
+
+extern char **environ;
+
+/* points in time (ms) of the startup phases, for the startup report */
+static struct {
+	int64_t start;		/* program started */
+	int64_t discovered;	/* cards found */
+	int64_t setup;		/* serial ports set up */
+	bool reported;
+} startup;
+
+static struct pcimax_loop loop = {
+	.epoll_fd = -1, .signal_fd = -1,
+	.notify_fd = -1, .debounce_fd = -1, .listen_fd = -1,
+	.debounce = PCIMAX_DEFAULT_DEBOUNCE,
+	.feed.fd = -1,
+	.batch.fd = -1, .batch.card = -1,
+	.timetable_fd = -1,
+};
+
+static void pcimax_usage_keys(const char *section);
+static void pcimax_journal_start(struct pcimax_card *card, uint32_t fields,
+				 const struct pcimax_values *settings);
+static void pcimax_journal_confirm(struct pcimax_card *card);
+static void pcimax_journal_finish(struct pcimax_card *card, uint32_t field);
+static bool pcimax_loop_add(int add_fd, uint32_t events, uint64_t data);
+static void pcimax_profiles_compile(struct pcimax_card *card,
+				    const struct pcimax_values *base);
+static int pcimax_profile_find(const char *name);
+static void pcimax_ta_keep(struct pcimax_values *settings);
 
 static void pcimax_usage_hint(void)
 {
@@ -148,6 +480,75 @@ static void pcimax_usage(void)
 	       "  -m, --monitor\n"
 	       "                     monitor config file for changes and auto\n"
 	       "                     update values when changes are detected\n"
+	       "  --debounce=<ms>\n"
+	       "                     time the config file has to stay unmodified\n"
+	       "                     before the changes are applied (monitor mode)\n"
+	       "                     default: 300\n"
+	       "  --delay=<ms>\n"
+	       "                     max delay after each command, the next command\n"
+	       "                     is sent earlier if the card answers earlier\n"
+	       "                     or was calibrated for shorter delays\n"
+	       "                     default: 200\n"
+	       "  --calibrate\n"
+	       "                     search the shortest delay the card needs for\n"
+	       "                     each kind of command and store it in the\n"
+	       "                     state directory, later runs use it. Sends\n"
+	       "                     the configured values of the commands\n"
+	       "  --verify=<command>\n"
+	       "                     for cards that don't answer: shell command\n"
+	       "                     run after each calibration trial, exit\n"
+	       "                     status 0 if the card took all commands\n"
+	       "                     ($PCIMAX_DEVICE, $PCIMAX_CLASS, $PCIMAX_DELAY)\n"
+	       "  --state-dir=<path>\n"
+	       "                     directory for the files recording the settings\n"
+	       "                     last sent to each card, settings that match\n"
+	       "                     are not sent again\n"
+	       "                     default: " PCIMAX_STATE_DIR "\n"
+	       "  --force\n"
+	       "                     send all settings, even if the card already\n"
+	       "                     has them\n"
+	       "  --dry-run\n"
+	       "                     print the commands that would be sent, with\n"
+	       "                     their decoded values and raw bytes, and\n"
+	       "                     estimate how long the cards are busy with\n"
+	       "                     them, the cards are not touched\n"
+	       "  --rescan\n"
+	       "                     search for the cards, instead of using the\n"
+	       "                     cards found last time (state directory)\n"
+	       "  --daemon\n"
+	       "                     keep running and accept set/get requests on\n"
+	       "                     the control socket. If a daemon is running,\n"
+	       "                     the settings given on the command line are\n"
+	       "                     passed on to it\n"
+	       "  --socket=<path>\n"
+	       "                     path of the control socket\n"
+	       "                     default: " PCIMAX_SOCKET "\n"
+	       "  --feed=<path>\n"
+	       "                     read RT updates line by line from a FIFO, or\n"
+	       "                     from stdin for \"-\". \"pty=<n>\" and \"ms=<m>\"\n"
+	       "                     lines update PTY / MS. Only the newest value\n"
+	       "                     is sent, once the card took the previous one\n"
+	       "  --batch=<path>\n"
+	       "                     read transactions of settings from a file, a\n"
+	       "                     FIFO or stdin for \"-\": <name>=<value> lines or\n"
+	       "                     config file fragments, a blank line or a\n"
+	       "                     \"commit\" line sends the values that changed.\n"
+	       "                     The ports stay open for the whole stream\n"
+	       "  --metrics=<path>\n"
+	       "                     write command counters and latencies to a\n"
+	       "                     file (Prometheus text format), updated after\n"
+	       "                     every update of the cards. A running daemon\n"
+	       "                     also reports them on the \"metrics\" request\n"
+	       "  --profile=<name>\n"
+	       "                     switch to a [profile:<name>] section of the\n"
+	       "                     config file, a running daemon switches with\n"
+	       "                     the commands it compiled at startup\n"
+	       "  -v, --verbose\n"
+	       "                     report every command that is sent, with its\n"
+	       "                     priority and the time it waited in the queue\n"
+	       "  --get=<name>\n"
+	       "                     query a setting (ini file name) from the\n"
+	       "                     running daemon, \"all\" queries every setting\n"
 	       );
 }
 
@@ -155,783 +556,3617 @@ static void pcimax_usage_fm(void)
 {
 	printf("\nFM related options: \n"
 	       "  --device=<device>\n"
-	       "                     set the target device\n"
-	       "                     default: auto-detect\n"
-	       "  --set-freq=<freq>\n"
-	       "                     set the frequency for the FM transmitter\n"
-	       "  --set-stereo=<true/false>\n"
-	       "                     set the transmitter into stereo / mono mode\n"
-	       "                     default = true => stereo\n"
-	       "                     !doesn't seem to have any effect\n"
-	       "  --set-power=<0..100>\n"
-	       "                     set the transmitter output power\n"
-	       "                     valid range: 0 .. 100\n"
+	       "                     set the target device, can be given several\n"
+	       "                     times to control multiple cards\n"
+	       "                     default: auto-detect, all cards found are used\n"
 	       );
+	pcimax_usage_keys("FM");
 }
-
 static void pcimax_usage_rds(void)
 {
-		printf("\nRDS related options: \n"
-	       "  --set-pi=<pi code>\n"
-	       "                     set the Program Identification code\n"
-	       "                     <pi code>: 0x0000 .. 0xFFFF or\n"
-	       "                                0 .. 65535\n"
-	       "  --set-pty=<pty code>\n"
-	       "                     set the Program Type Code\n"
-	       "                     <pty code> 0..31\n"
-	       "  --set-ps=<station_name>\n"
-	       "                     set the Program Station Name\n"
-	       "                     length is limited to 8 chars\n"
-	       "  --set-rt=<radio_text>\n"
-	       "                     set the Radio Text\n"
-	       "                     length is limited to 64 chars\n"
-	       "  --set-ecc=<ecc>\n"
-	       "                     set the Extended country code\n"
-	       "                     <ecc> 0..4 or e0..e4 or E0..E4\n"
-	       "  --set-af=<af list>\n"
-	       "                     set the alternative frequencies for the station\n"
-	       "                     <af list>: e.g. 88.9,101.2\n"
-	       "                     max size of af list: 6\n"
-	       "  --set-tp=<true/false>\n"
-	       "                     set the Traffic Program flag\n"
-	       "  --set-ta=<true/false>\n"
-	       "                     set the Traffic Anouncement flag\n"
-	       "  --set-ms=<true/false>\n"
-	       "                     set the Music/Speech flag\n"
-	       "                     <true> -> music, <false> -> speech\n"
-	       );
+	printf("\nRDS related options: \n");
+	pcimax_usage_keys("RDS");
 }
 
-/* try to auto-detect connected pcimax3000+ devices, by comparing the Vendor
- * and Product ID for the USB-to-Serial IC to all tty devices of the system
- * code inspired by: http://www.signal11.us/oss/udev/ */
-static const char* pcimax_find_device(void)
+/* adds a card to the list of controlled cards
+ * @syspath:	sysfs path of the tty device, NULL if unknown
+ * @ret_val:	NULL if the max number of cards is reached */
+static struct pcimax_card *pcimax_card_add(const char *device, const char *syspath)
 {
-	struct udev *udev;
-	struct udev_enumerate *enumerate;
-	struct udev_list_entry *devices, *dev_list_entry;
-	struct udev_device *dev;
-	const char *id_product = "ea60";
-	const char *id_vendor = "10c4";
-	const char *path;
-	const char *product_buf;
-	const char *vendor_buf;
-	static char device[80];
-	bool device_found = false;
-
-	/* create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		fprintf(stderr, "Device auto-detection: Can't create udev\n");
-		exit(1);
+	struct pcimax_card *card;
+
+	if (card_count >= PCIMAX_CARD_MAX) {
+		fprintf(stderr, "Too many cards, %s is ignored\n", device);
+		return NULL;
 	}
+	card = &cards[card_count++];
+	memset(card, 0, sizeof(*card));
+	snprintf(card->device, sizeof(card->device), "%.*s",
+		 (int)sizeof(card->device) - 1, device);
+	if (syspath)
+		snprintf(card->syspath, sizeof(card->syspath), "%s", syspath);
+	card->fd = -1;
+	card->timer_fd = -1;
+	return card;
+}
 
-	/* create a list of all devices in the 'tty' subsystem */
-	enumerate = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(enumerate, "tty");
-	udev_enumerate_scan_devices(enumerate);
-	devices = udev_enumerate_get_list_entry(enumerate);
-
-	/* check each item in the list, if it used the same USB to Serial
-	 * IC as the the pcimax3000+ card */
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		/* get the filename of the /sys entry for the device
-		 * create a udev_device object (dev) representing it */
-		path = udev_list_entry_get_name(dev_list_entry);
-		dev = udev_device_new_from_syspath(udev, path);
-		/* store the device path in the /dev/ filesystem */
-		strncpy(device, udev_device_get_devnode(dev), 80); 
-		/* to get information about the device, get the parent device 
-		 * with the subsystem/devtype pair of "usb"/"usb_device" */
-		dev = udev_device_get_parent_with_subsystem_devtype(
-		       dev, "usb", "usb_device");
-		if (!dev) {
-			udev_device_unref(dev);
-			continue;
-		}
+/* loads the cards that were found last time from the device cache, which is
+ * only trusted if no USB serial device came or went since it was written
+ * (modification time of the by-id directory) and all cached names still
+ * lead to a tty device
+ * @dir:	directory holding the cache
+ * @ret_val:	false if the cache is missing or outdated */
+static bool pcimax_cache_load(const char *dir)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX];
+	struct pcimax_card *card;
+	struct stat st;
+	long long sec;
+	long nsec;
+	bool valid;
+	FILE *file;
 
-		/* check if the tty device matches the USB to Serial 
-		 * converter that's used on the pcimax3000+ card */
-		product_buf = udev_device_get_sysattr_value(dev, "idProduct");
-		vendor_buf = udev_device_get_sysattr_value(dev, "idVendor");
-		if (strncmp(id_product, product_buf, 4) == 0 &&
-			strncmp(id_vendor, vendor_buf, 4) == 0) {
-			printf("Found pcimax3000+ card at %s\n", device);
-			device_found = true;
+	if (stat(PCIMAX_BY_ID_DIR, &st) < 0)
+		return false;
+	snprintf(path, sizeof(path), "%s/%s", dir, PCIMAX_CACHE_FILE);
+	file = fopen(path, "r");
+	if (!file)
+		return false;
+	valid = fscanf(file, "dir %lld %ld\n", &sec, &nsec) == 2 &&
+		sec == (long long)st.st_mtim.tv_sec && nsec == st.st_mtim.tv_nsec;
+	while (valid && fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "card ", 5))
+			continue;
+		if (stat(line + 5, &st) < 0 || !S_ISCHR(st.st_mode)) {
+			valid = false;
 			break;
 		}
-		udev_device_unref(dev);
+		card = pcimax_card_add(line + 5, NULL);
+		if (card)
+			snprintf(card->link, sizeof(card->link), "%s", line + 5);
+	}
+	fclose(file);
+
+	if (!valid || !card_count) {
+		card_count = 0;
+		return false;
+	}
+	for (size_t i = 0; i < card_count; i++)
+		printf("Found pcimax3000+ card at %s (cached)\n", cards[i].device);
+	return true;
+}
+
+/* records the stable names of the cards that were found in the device cache,
+ * nothing is cached if a card has no stable name */
+static void pcimax_cache_save(const char *dir)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+	struct stat st;
+	FILE *file;
+
+	for (size_t i = 0; i < card_count; i++) {
+		if (!cards[i].link[0])
+			return;
+	}
+	if (stat(PCIMAX_BY_ID_DIR, &st) < 0)
+		return;
+	mkdir(dir, 0755);
+	snprintf(path, sizeof(path), "%s/%s", dir, PCIMAX_CACHE_FILE);
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	file = fopen(tmp, "w");
+	if (!file)
+		return;
+	fprintf(file, "dir %lld %ld\n", (long long)st.st_mtim.tv_sec,
+		(long)st.st_mtim.tv_nsec);
+	for (size_t i = 0; i < card_count; i++)
+		fprintf(file, "card %s\n", cards[i].link);
+	/* replace the old cache atomically */
+	if (fclose(file) || rename(tmp, path))
+		unlink(tmp);
+}
+
+/* try to auto-detect connected pcimax3000+ devices, by comparing the Vendor
+ * and Product ID for the USB-to-Serial IC to all tty devices of the system,
+ * every card that is found is added to the list of cards
+ * @cache_dir:	directory of the device cache, NULL to search in any case */
+static void pcimax_find_devices(const char *cache_dir)
+{
+	static struct pcimax_device found[PCIMAX_CARD_MAX + 1];
+	struct pcimax_card *card;
+	int count;
+
+	if (cache_dir && pcimax_cache_load(cache_dir))
+		return;
+
+	count = pcimax_discover(found, PCIMAX_CARD_MAX + 1);
+	if (count < 0) {
+		fprintf(stderr, "Device auto-detection: %s\n", strerror(-count));
+		exit(1);
+	}
+	for (int i = 0; i < count; i++) {
+		printf("Found pcimax3000+ card at %s\n", found[i].device);
+		card = pcimax_card_add(found[i].device, found[i].syspath);
+		/* remember the stable name of the card for the device cache */
+		if (card)
+			memcpy(card->link, found[i].link, sizeof(card->link));
 	}
-	/* free the enumerator object */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
 
 	/* end the program if no card could be detected */
-	if (!device_found) {
+	if (!card_count) {
 		fprintf(stderr, "No pcimax3000+ card detected, exiting now\n");
 		exit(1);
 	}
+	if (cache_dir)
+		pcimax_cache_save(cache_dir);
+}
+
+/* looks up the USB serial number and the sysfs path of the card behind its
+ * tty device, and derives the name of its state file from them: the serial,
+ * or the path of the device if the serial can't be determined */
+static void pcimax_card_identify(struct pcimax_card *card)
+{
+	struct pcimax_device device;
+	char *pos;
+
+	memset(&device, 0, sizeof(device));
+	snprintf(device.device, sizeof(device.device), "%s", card->device);
+	snprintf(device.syspath, sizeof(device.syspath), "%s", card->syspath);
+	pcimax_identify(&device);
+	snprintf(card->syspath, sizeof(card->syspath), "%s", device.syspath);
+	snprintf(card->serial, sizeof(card->serial), "%s", device.serial);
 
-	return device;
+	snprintf(card->key, sizeof(card->key), "%.*s", (int)sizeof(card->key) - 1,
+		 card->serial[0] ? card->serial : card->device);
+	/* keep the key usable as file name */
+	for (pos = card->key; *pos; pos++) {
+		if (!isalnum(*pos) && *pos != '-' && *pos != '.')
+			*pos = '_';
+	}
 }
 
-/* resores the terminal settings to the state they were before the program
- * made any changes */
-static void pcimax_exit(int fd, bool reset)
+/* checks if a card is known by @id: its USB serial, the sysfs path or the
+ * path of its tty device, or the name of its state file */
+static bool pcimax_card_match(const struct pcimax_card *card, const char *id)
 {
-	if (reset)
-		pcimax_set_settings(fd, &old_settings);
-	close(fd);
-	exit(-1);
+	return (card->serial[0] && strcmp(card->serial, id) == 0) ||
+	       (card->syspath[0] && strcmp(card->syspath, id) == 0) ||
+	       strcmp(card->device, id) == 0 || strcmp(card->key, id) == 0;
 }
 
-static int pcimax_open_serial(const char* device)
+/* @ret_val:	the card known by @id, NULL if there is none */
+static struct pcimax_card *pcimax_card_find(const char *id)
 {
-	int fd = -1; 
-	/* O_NONBLOCK -> return immediately
-	 * O_NOCTTY -> we're not the controlling terminal */
-	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (fd < 0){
-		fprintf(stderr, "Unable to open %s", device);
-		perror(": ");
-		pcimax_exit(fd, false);
+	for (size_t i = 0; i < card_count; i++) {
+		if (pcimax_card_match(&cards[i], id))
+			return &cards[i];
 	}
-	return fd;
+	return NULL;
 }
 
-static void pcimax_set_settings(int fd, const struct termios *settings)
+/* prefixes the messages about a card with its name, if several cards are
+ * controlled */
+static void pcimax_card_prefix(const struct pcimax_card *card)
 {
-	/* TSCNOW -> change occurs immediately */
-	tcflush(fd, TCIFLUSH);
-	if (tcsetattr(fd, TCSANOW, settings) < 0) {
-		perror("tcsetattr: ");
-		pcimax_exit(fd, true);
-	}
+	if (card_count > 1)
+		printf("[%s] ", card->key);
 }
 
-/* place the terminal 'fd' into PCIMAX3000+ compatible mode
- * @fd:		file descriptor for a terminal device
- * @ret_val:	0 on success, -1 on error */
-/* TODO: figure out the minimal set of settings for proper communication */ 
-static void pcimax_setup_serial(int fd)
+/* resores the terminal settings of all cards to the state they were before
+ * the program made any changes and terminates the program */
+static void pcimax_close_cards(void)
 {
-	struct termios new_settings;
-	uint32_t modem_ctl_ioctl;
-	
-	/* Get the current settings for the port */
-	if (tcgetattr(fd, &old_settings)) {
-		perror("tcgetattr: ");
-		pcimax_exit(fd, false);
-	}
-	new_settings = old_settings;
-
-	/* adopt the settings according to the requirements of the 
-	 * PCIMAX3000+ card */
-	new_settings.c_cflag = B9600 | CS8 | CREAD | CLOCAL;
-	new_settings.c_cflag &= ~CRTSCTS;
-	new_settings.c_iflag = IGNBRK;
-	new_settings.c_oflag = ONLCR;
-	new_settings.c_lflag = ECHOE | ECHOK | NOFLSH | ECHOCTL;
-	new_settings.c_line = 0;
-	new_settings.c_cc[VMIN] = 0;
-	new_settings.c_cc[VTIME] = 0;
-	new_settings.c_cc[VEOF] = 26; /* => ^Z */
-	/* disable {SUSP,  REPRINT, WERASE, LNEXT} characters */ 
-	new_settings.c_cc[VSUSP] = fpathconf(fd, _PC_VDISABLE);
-	new_settings.c_cc[VREPRINT] = fpathconf(fd, _PC_VDISABLE);
-	new_settings.c_cc[VWERASE] = fpathconf(fd, _PC_VDISABLE);
-	new_settings.c_cc[VLNEXT] = fpathconf(fd, _PC_VDISABLE);
-
-	/* Set the baud rates to 9600 */
-	cfsetispeed(&new_settings, B9600);
-	cfsetospeed(&new_settings, B9600);
-
-	/* enable the Request to Send line & Data Terminal Ready*/
-	ioctl(fd, TIOCMGET, &modem_ctl_ioctl);
-	modem_ctl_ioctl |= TIOCM_RTS | TIOCM_DTR;
-	ioctl(fd, TIOCMSET, &modem_ctl_ioctl);
-
-	pcimax_set_settings(fd, &new_settings);
-}
-
-/* wrapper for write function that performs error checking, and
- * terminates the program if an error is detected */
-static int pcimax_write(int fd, const void *buf, size_t count)
-{
-	int wr_count = 0;
-	if ((wr_count = write(fd, buf, count)) == -1) {
-		perror("write error: ");
-		pcimax_exit(fd, true);
-	}
-	return wr_count;
-}
-
-/* @cmd:	c string or char array with terminating null byte
- * @data:	c string or char array 
- * @data_count:	number of data bytes to transmit */
-static void pcimax_send_command(int fd, const char *cmd, const char *data, size_t data_count)
-{
-	static const char start = 0x00;		/* start of new command */
-	static const char end_cmd = 0x01;	/* eof command, sof data */
-	static const char finish = 0x02;	/* eof data */ 
-
-	pcimax_write(fd, &start, 1); 
-	pcimax_write(fd, cmd, strlen((char*)cmd));
-	pcimax_write(fd, &end_cmd, 1);
-	pcimax_write(fd, data, data_count);
-	pcimax_write(fd, &finish, 1); 
-	/* there has to be a delay after every command
-	 * 200ms is used in official program */
-	usleep(200 * 1000L);
-}
-
-/* encodes the integer frequency value into a string representation
- * @freq:	integer range 87500..108000 
- * @ret_val:	\0 terminated character array*/
-static const char* pcimax_get_freq(uint32_t new_freq)
-{
-	static char freq_str[3] = {'0', '0', '\0'};
-	char high_byte = 0;
-	char low_byte = 0;
-	uint32_t freq_fifth = (uint32_t)(new_freq / 5);
-	
-	/* chars 0x00, 0x01, 0x02 are reserved as special control characters
-	 * by the device -> add 4 to results */
-	high_byte = (char)((uint32_t)(freq_fifth / 128) + 4);
-	low_byte = (char)((freq_fifth - (uint32_t)(freq_fifth / 128) * 128) + 4);
-	freq_str[0] = low_byte;
-	freq_str[1] = high_byte;
-	return freq_str;
-}
-
-/* encodes the integer power value into a string representation
- * @power:	interger range 0..100
- * @ret_val:	\0 terminated array*/
-static const char* pcimax_get_power(uint8_t power)
-{
-	static char power_str[2] = { 0x19, '\0'};
-
-	/* valid range of values for RDS encoder 0x03..0x19 */
-	if (power >= 0 && power <= 100)
-		power_str[0] = (char)(power / 100.0f * 21) + 4;
-	return power_str;
-}
-
-/* TODO: do the power & stereo settings have any effect? 
- * -> submitting a value for "F0" command yields in no detectable transmission */
-/* Updates / Sets the FM Transmitter related settings
- * Frequency, Output Power and Stero/Mono mode */
-static void pcimax_set_fm_settings(int fd, const struct pcimax_settings *settings)
-{
-	/* setting stereo / mono mode */
-	if (settings->defined & PCIMAX_STEREO) {
-		printf("Setting transmitter to %s mode\n", 
-			(settings->is_stereo) ? "stereo" : "mono");
-		pcimax_send_command(fd, "FS", &settings->is_stereo, 1);
-	}
-	/* setting transmitter frequency */
-	if (settings->defined & PCIMAX_FREQ) {
-		printf("Setting transmitter to %.1fMHz\n", (settings->freq / 1000.0f));
-		const char *freq = pcimax_get_freq(settings->freq);
-		pcimax_send_command(fd, "FF", freq, 2);
-	}
-	/* setting output power */
-	if (settings->defined & PCIMAX_PWR) {
-		printf("Setting transmitter power to %d%%\n", settings->power);
-		const char *pow = pcimax_get_power(settings->power);
-		pcimax_send_command(fd, "FO", pow, 1);
-	}
-	/* store the settings, commit changes */
-	pcimax_send_command(fd, "FW", "0", 1);
-}
-
-/* pcimax3000+ protocol expects a trans-coded alternative frequency 
- * representation. The lowest possible frequency 87.6MHz maps to 1, and
- * the frequency is increased  by 0.1MHz per step, so that the
- * highest possible frequency 108MHz maps to 205 */ 
-static char pcimax_get_af_code(uint32_t freq)
-{
-	/* +4 -> add the offset to skip the reserved control codes */
-	return (freq - 87500) / 100 + 4;
-}
-
-/* TODO: add Country code and AreaCoverage fields to settings, or calculate them
- * from the given PI code */
-/* Updates / Sets RDS related settings */
-static void pcimax_set_rds_settings(int fd, const struct pcimax_settings *settings)
-{
-	char buffer[65]; 
-	/* the cards used the value 0x00, 0x01 and 0x02 as special control commands
-	 * a offset has to be added to data guarantee that it is not interpreted as
-	 * a control command */
-	uint8_t offset = 4;
-
-	/* enable RDS output */
-	pcimax_send_command(fd, "PWR", "1", 1);
-
-	/* setting PI code 
-	 * RDS-Standard for short range transmitters: 
-	 * (see IEC62106: Annex D table D.5)
-	 * bits 0-7: Program reference number
-	 * bits 8-11: Program in terms of area coverage
-	 * 	1 (hex) when device uses an AF list
-	 * 	0 (hex) when no AF list is used 
-	 * bits 12-15: Country code - a fixed value between 0x01 and 0x0f
-	 * atm the program will not enforce these values but let the user
-	 * select the PI code freely (might be changed) */
-	if (settings->defined & PCIMAX_PI) {
-		printf("Setting RDS PI to 0x%02x%02x\n", settings->pi[0], 
-			settings->pi[1]);
-		/* low byte of PI */
-		sprintf(buffer, "%03u", settings->pi[0]);
-		pcimax_send_command(fd, "CCAC", buffer, 3);
-		/* Program reference, high byte of PI */
-		sprintf(buffer, "%03u", settings->pi[1]);
-		pcimax_send_command(fd, "PREF", buffer, 3);
-	}
-	/* setting PTY code */
-	if (settings->defined & PCIMAX_PTY) {
-		printf("Setting RDS PTY to %s\n", settings->pty);
-		pcimax_send_command(fd, "PTY", settings->pty, 2); 
-	}
-	/* setting TP code */
-	if (settings->defined & PCIMAX_TP) {
-		printf("Setting RDS TP flag to %s\n", (settings->tp == '1') ? "true" : "false");
-		pcimax_send_command(fd, "TP", &settings->tp, 1);
-	}
-	/* setting TA code */
-	if (settings->defined & PCIMAX_TA) {
-		printf("Setting RDS TA flag to %s\n", (settings->ta == '1') ? "true" : "false");
-		pcimax_send_command(fd, "TA", &settings->ta, 1);
-	}
-	/* setting MS code */
-	if (settings->defined & PCIMAX_MS) {
-		printf("Setting RDS m/s flag to %s\n", (settings->ms == '1') ? "music" : "speech");
-		pcimax_send_command(fd, "MS", &settings->ms, 1);
-	}
-	/* setting DI code (Decode Information) */
-	if (settings->defined & PCIMAX_DI) {
-		printf("Setting RDS Decoder Information flags\n");
-		printf("  --> mode: %s, artificial head: %c, \n  --> compression: %c, dynamic PTY: %c\n",
-			(settings->is_stereo == '1')? "stereo" : "mono", settings->di_artificial,
-			settings->di_compression, settings->di_dynamic_pty);
-		/* use the FM-Transmitter setting for mono/stereo flag */
-		pcimax_send_command(fd, "Did0", "1", settings->is_stereo);
-		pcimax_send_command(fd, "Did1", "1", settings->di_artificial); /* artificial head */
-		pcimax_send_command(fd, "Did2", "1", settings->di_compression); /* compression */
-		pcimax_send_command(fd, "Did3", "1", settings->di_dynamic_pty); /* dynamic PTY */
-	}
-	/* setting AF codes alternative frequencies */
-	/* n AF + magic number + offset = number of defined AFs 
-	 * maximal AFs = 7 */
-	buffer[0] = settings->af_size + 224 + offset;
-	pcimax_send_command(fd, "AF0", buffer, 1);  /* number of defined AFs */
-	for (uint8_t i = 1; i <= 7;  i++) {
-		char af;
-		/* set all defined AFs to the desired frequency and the
-		 * rest to 0 */
-		sprintf(buffer, "AF%u", i);
-		if (i > settings->af_size) {
-			pcimax_send_command(fd, buffer, "0", 1);
+	for (size_t i = 0; i < card_count; i++) {
+		if (cards[i].fd < 0)
 			continue;
-		}
-		printf("Setting %s to %0.1f\n", buffer, 
-			settings->af[i-1] / 1000.0f);
-		af = pcimax_get_af_code(settings->af[i-1]);
-		pcimax_send_command(fd, buffer, &af, 1);
-	}
-
-	/* setting ECC code (country code, value range 1..5 + offset) */
-	buffer[0] = settings->ecc + offset;
-	if (settings->defined & PCIMAX_ECC) {
-		printf("Setting RDS ECC code to E%u\n", settings->ecc - 1);
-		pcimax_send_command(fd, "ECC", buffer, 1);
-	}
-	/* setting the RT */
-	/* a) when setting a new RT the old value is not flushed but over-
-	 * written. If the new RT is shorter than the old one, parts of
-	 * the old RT will still be transmitted. To solve this problem the
-	 * buffer is filled with space characters before setting the new RT 
-	 * b) RDS standard features an RDS RT a/b flag to notify the receiver
-	 * the receiver that new RT will be transmitted. Pcimax3000+ does not
-	 * support this */
-	if (settings->defined & PCIMAX_RT) {
-		printf("Setting RDS RT to: %s\n", settings->rt); 
-		/* overwrite the old RT with space characters */
-		memset(buffer, 0x20, 64);
-		pcimax_send_command(fd, "RT", buffer, 64);
-		pcimax_send_command(fd, "RT", settings->rt, strlen(settings->rt));
-	}
-	/* setting PS name */
-	/* Even though pcimax3000+ features dynamic station names this
-	 * program only supports static station naming, as the the RDS
-	 * standard specifically states that the PS feature shouldn't
-	 * be used dynamically */
-	if (settings->defined & PCIMAX_PS) {
-		printf("Setting RDS PS to: %s\n", settings->ps);
-		/* overwrite the old PS with space characters */
-		memset(buffer, 0x20, 64);
-		pcimax_send_command(fd, "PS00", buffer, 8);
-		pcimax_send_command(fd, "PS00", settings->ps, 8);
-		for (uint8_t i = 1; i < 40; i++) {
-			sprintf(buffer, "PS%02u", i);
-			pcimax_send_command(fd, buffer, "NULL", 4);
-		}
-		/* setting the delays for dynamic PS (disabeling the dynamic PS feature)
-		 * there are 40 fields available, all of them have to be set */
-		pcimax_send_command(fd, "PD00", "1", 1);
-		for (uint8_t i = 1; i < 40; i++) {
-			sprintf(buffer, "PD%02u", i);
-			pcimax_send_command(fd, buffer, "0", 1);
-		}
-	}
-}
-
-/* replaces terminating null characters in char arrays (strings) with spaces
- * @string:	ptr to a char array
- * @replacement:character used for replacement
- * @length:	length of the array
- * used to modify strings so that their whole length will be sent over the
- * serial line, in order to overwrite remainings of old strings */
-void pcimax_replace_terminating_null(char *string, char replacement, uint32_t length)
-{
-	for(uint32_t i = 0; i < length; i++) {
-		if (string[i] == '\0')
-			string[i] = replacement;
-	}
-}
-
-void pcimax_parse_ecc(struct pcimax_settings *settings, const char *value)
-{
-	settings->defined |= PCIMAX_RDS | PCIMAX_ECC;
-	if (value[0] == 'e' || value[0] == 'E')
-		value++;
-	if (value[0] >= '0' && value[0] <= '4')
-		/* the card expects values from 1 to 5, but the codes 
-		 * are specified as E0..E4 --> add +1 */
-		settings->ecc = (char)strtol(value, NULL, 10) + 1;
-	else {
-		fprintf(stderr, "Unsupported ECC given: %c\n", value[0]);
-		exit(1);
+		pcimax_serial_close(cards[i].fd, &cards[i].old_settings);
+		cards[i].fd = -1;
 	}
 }
 
-void pcimax_parse_pi(struct pcimax_settings *settings, const char *value)
+static void pcimax_exit(void)
 {
-	int tmp = 0;
-	
-	settings->defined |= PCIMAX_PI | PCIMAX_RDS;
-	if (value[0] == '0' && value[1] == 'x')
-		tmp = strtol(value, NULL, 16);
-	else
-		tmp = strtol(value, NULL, 10);
-	settings->pi[1] = (uint8_t) tmp & 0Xff;
-	settings->pi[0] = (uint8_t) (tmp >> 8) & 0x0ff;
+	pcimax_close_cards();
+	exit(-1);
 }
 
-void pcimax_parse_af(struct pcimax_settings *settings, const char *value)
+/* returns the value of the monotonic clock in ms */
+static int64_t pcimax_now_ms(void)
 {
-	char buffer[10];
-	int length = strlen(value);
-	int pos = 0;
-	int start = 0; 
-	
-	/* find sub-strings, delimited by ',' or ' ' and convert them into
-	 * integer values */ 
-	while(pos <= length) {
-		if (value[pos] == ',' || value[pos] == ' ' || pos == length) {
-			settings->defined |= PCIMAX_PI | PCIMAX_RDS;
-			memset(buffer, 0, 10*sizeof(char));
-			strncpy(buffer, &value[start], pos-start);
-			settings->af[settings->af_size++] = strtof(buffer, NULL) * 1000.0f;
-			start = pos + 1 ;
-			/* pcimax3000+ supports only 7 AFs */	
-			if (settings->af_size >= 7)
-				break;
-		}
-		pos++;
-	}
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-/* callback function for the ini file parsing library */
-int pcimax_ini_cb(void* buffer, const char* section, const char* name, const char* value)
+/* returns the value of the monotonic clock in us */
+static int64_t pcimax_now_us(void)
 {
-	#define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
-	struct pcimax_settings *settings = (struct pcimax_settings*) buffer;
-	int i;
-	
-	/* FM Settings */
-	if (MATCH("FM", "freq")) {
-		settings->defined |= PCIMAX_FREQ | PCIMAX_FM;
-		settings->freq = strtod(value, NULL) * 1000;
-	} else if (MATCH("FM", "stereo")) {
-		settings->defined |= PCIMAX_STEREO | PCIMAX_FM;
-		settings->is_stereo = strcmp(value, "false")? '1' : '0';
-	} else if (MATCH("FM", "power")) {
-		settings->defined |= PCIMAX_PWR | PCIMAX_FM;
-		i = strtol(value, 0L, 0);
-		settings->power = (i >= 0 && i <= 100)? i : 100;
-	} 
-	
-	/* RDS Settings */
-	if (MATCH("RDS", "pi")) {
-		pcimax_parse_pi(settings, value);
-	} else if (MATCH("RDS", "pty")) {
-		settings->defined |= PCIMAX_PTY | PCIMAX_RDS;
-		strncpy(settings->pty, value, 2);
-	} else if (MATCH("RDS", "ps")) {
-		settings->defined |= PCIMAX_PS | PCIMAX_RDS;
-		strncpy(settings->ps, value, 8);
-	} else if (MATCH("RDS", "rt")) {
-		settings->defined |= PCIMAX_RT | PCIMAX_RDS;
-		strncpy(settings->rt, value, 64);
-	} else if (MATCH("RDS", "ecc")) {
-		pcimax_parse_ecc(settings, value);
-	} else if (MATCH("RDS", "tp")) {
-		settings->defined |= PCIMAX_TP | PCIMAX_RDS;
-		settings->tp = strcmp(value, "false")? '1' : '0';
-	} else if (MATCH("RDS", "ta")) {
-		settings->defined |= PCIMAX_TA | PCIMAX_RDS;
-		settings->ta = strcmp(value, "false")? '1' : '0';
-	} else if (MATCH("RDS", "ms")) {
-		settings->defined |= PCIMAX_MS | PCIMAX_RDS;
-		settings->ms = strcmp(value, "music")? '0' : '1';
-	} else if (MATCH("RDS", "af")) {
-		pcimax_parse_af(settings, value);
-	} else if (MATCH("RDS", "di_artificial")) {
-		settings->defined |= PCIMAX_DI | PCIMAX_RDS;
-		settings->di_artificial = strcmp(value, "false")? '1' : '0';
-	} else if (MATCH("RDS", "di_compression")) {
-		settings->defined |= PCIMAX_DI | PCIMAX_RDS;
-		settings->di_compression = strcmp(value, "false")? '1' : '0';
-	} else if (MATCH("RDS", "di_dynamic_pty")) {
-		settings->defined |= PCIMAX_DI | PCIMAX_RDS;
-		settings->di_dynamic_pty = strcmp(value, "false")? '1' : '0';
-	}
+	struct timespec ts;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-/* parse the command line into the settings struct */
-uint32_t pcimax_parse_cl(int argc, char **argv,
-			struct pcimax_settings *settings)
+/* @ret_val:	time (us) @bytes take on the serial line */
+static uint64_t pcimax_wire_us(size_t bytes)
 {
-	int i = 0;
-	int idx = 0;
-	int ch = 0;
-	double freq;
-	/* 26 letters in the alphabet, case sensitive = 26 * 2 possible
-	 * short options, where each option requires at most two chars
-	 * {option, optional argument} */
-	char short_options[26 * 2 * 2 + 1];
+	return (uint64_t)bytes * 10 * 1000000 / PCIMAX_BAUD;
+}
 
-	if (argc == 1) {
-		pcimax_usage_hint();
-		exit(1);
-	}
-	/* parse command line options */
-	for (i = 0; long_options[i].name; i++) {
-		if (!isalpha(long_options[i].val))
-			continue;
-		short_options[idx++] = long_options[i].val;
-		if (long_options[i].has_arg == required_argument)
-			short_options[idx++] = ':';
-	}
+/* reports how long the startup took, once the first command was processed
+ * by a card */
+static void pcimax_startup_report(void)
+{
+	if (startup.reported || !startup.setup)
+		return;
+	startup.reported = true;
+	printf("Startup took %lld ms: discovery %lld ms, port setup %lld ms, "
+	       "first command %lld ms\n",
+	       (long long)(pcimax_now_ms() - startup.start),
+	       (long long)(startup.discovered - startup.start),
+	       (long long)(startup.setup - startup.discovered),
+	       (long long)(pcimax_now_ms() - startup.setup));
+}
 
-	while(1){
-		int option_index = 0;
+/* arms the pacing timer of a card
+ * @at:	point in time (monotonic clock, ms) at which the timer fires */
+static void pcimax_timer_arm(int timer_fd, int64_t at)
+{
+	struct itimerspec its = { .it_interval = { 0, 0 } };
 
-		short_options[idx] = 0;
-		ch = getopt_long(argc, argv, short_options,
-				 long_options, &option_index);
-		if (ch == -1)
-			break;
+	/* a zero value would disarm the timer */
+	if (at <= 0)
+		at = 1;
+	its.it_value.tv_sec = at / 1000;
+	its.it_value.tv_nsec = (at % 1000) * 1000000;
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-		settings->options[(int)ch] = 1;
-		switch (ch){
-		case OptFile:
-			if (access(optarg, F_OK) != -1)
-				strncpy(settings->file, optarg, 80);
-			else {
-				fprintf(stderr, "Unable to open ini file: %s\n", optarg);
-				exit(1);
-			}
-			break;
-		case OptSetDevice:
-			memset(settings->device, 0, 80);
-			if (access(optarg, F_OK) != -1)
-				strncpy(settings->device, optarg, 80);
-			else {
-				fprintf(stderr, "Unable to open device: %s\n", optarg);
-				exit(1);
-			}
-			break; 
-		case OptSetFreq:
-			settings->defined |= PCIMAX_FREQ | PCIMAX_FM;
-			freq = strtod(optarg, NULL);
-			settings->freq = freq * 1000;
-			break;
-		case OptSetAF:
-			pcimax_parse_af(settings, optarg);
-			break;
-		case OptSetECC:
-			pcimax_parse_ecc(settings, optarg);
-			break;
-		case OptSetStereo:
-			settings->defined |= PCIMAX_STEREO | PCIMAX_FM;
-			settings->is_stereo = strcmp(optarg, "false")? '1' : '0';
-			break;
-		case OptSetPower:
-			settings->defined |= PCIMAX_PWR | PCIMAX_FM;
-			i = strtol(optarg, 0L, 0);
-			settings->power = (i >= 0 && i <= 100)? i : 100;
-			break;
-		case OptSetPI:
-			pcimax_parse_pi(settings, optarg);
-			break;
-		case OptSetPTY:
-			settings->defined |= PCIMAX_PTY | PCIMAX_RDS;
-			strncpy(settings->pty, optarg, 2);
-			break;
-		case OptSetPS:
-			settings->defined |= PCIMAX_PS | PCIMAX_RDS;
-			strncpy(settings->ps, optarg, 8);
-			break;
-		case OptSetRT:
-			settings->defined |= PCIMAX_RT | PCIMAX_RDS;
-			strncpy(settings->rt, optarg, 64);
-			break;
-		case OptSetTP:
-			settings->defined |= PCIMAX_TP | PCIMAX_RDS;
-			settings->tp = strcmp(optarg, "false")? '1' : '0';
-			break;
-		case OptSetTA:
-			settings->defined |= PCIMAX_TA | PCIMAX_RDS;
-			settings->ta = strcmp(optarg, "false")? '1' : '0';
-			break;
-		case OptSetMS:
-			settings->defined |= PCIMAX_MS | PCIMAX_RDS;
-			settings->ms = strcmp(optarg, "false")? '1' : '0';
-			break;
-		case OptHelp:
-			pcimax_usage();
-			pcimax_usage_fm();
-			pcimax_usage_rds();
-			exit(1);
-			break;
-		case ':':
-			fprintf(stderr, "Option '%s' requires a value\n",
-				argv[optind]);
-			pcimax_usage_hint();
-			exit(1);
-		case '?':
-			if (argv[optind])
-				fprintf(stderr, "Unknown argument '%s'\n", argv[optind]);
-			pcimax_usage_hint();
-			exit(1);
-		}
-	}
-	if (optind < argc) {
-		printf("unknown arguments: ");
-		while (optind < argc)
-			printf("%s ", argv[optind++]);
-		printf("\n");
-		pcimax_usage_hint();
-		return 1;
-	}
+/* enables / disables the writability events of the serial line */
+static void pcimax_serial_watch_out(const struct pcimax_card *card, bool enable)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (enable ? EPOLLOUT : 0),
+		.data.u64 = PCIMAX_SRC_SERIAL | (uint64_t)(card - cards) << 32,
+	};
 
-	return 0;
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, card->fd, &ev);
+}
+
+/* returns the priority class of the commands of a setting
+ * @replay:	priority when the settings are replayed to a card that was
+ *		reconnected, the card has to get back on air first */
+static enum pcimax_priority pcimax_field_priority(uint32_t field, bool replay)
+{
+	const struct pcimax_key *key = pcimax_field_key(field);
+
+	if (!key)
+		return PCIMAX_PRIO_NORMAL;
+	return replay ? key->replay : key->priority;
 }
 
-/* a signal handler for the ctrl+c interrupt, in order to end the program
- * gracefully (restoring terminal settings and closing fd) */
-static void signal_handler_interrupt(int signum)
+/* @ret_val:	command class of the commands of a setting */
+static enum pcimax_cmd_class pcimax_field_class(uint32_t field)
 {
-	fprintf(stderr, "Interrupt received: Terminating program\n");
-	pcimax_exit(fd, true);
+	const struct pcimax_key *key = pcimax_field_key(field);
+
+	return key ? key->cls : PCIMAX_CLASS_FLAG;
 }
-void pcimax_monitor_loop(int fd, struct pcimax_settings *settings)
+
+/* @ret_val:	max time the card gets to process the command of @frame,
+ *		the calibrated delay if it is shorter than --delay */
+static uint32_t pcimax_card_delay(const struct pcimax_card *card,
+				  const struct pcimax_frame *frame)
 {
-	#define BUF_LEN sizeof(struct inotify_event) + NAME_MAX + 1
-	int notify_fd;
-	int watch_fd;
-	int rd_cnt;
-	char buffer[BUF_LEN];
+	uint32_t delay = card->timing[pcimax_field_class(frame->field)];
 
-	/* initialize inotify instance */
-	notify_fd = inotify_init();
-	if (notify_fd == -1) {
-		fprintf(stderr, "Error initializing inotify instance\n");
-		return;
+	return (delay && delay < cmd_delay) ? delay : cmd_delay;
+}
+
+/* adds a duration to a histogram */
+static void pcimax_hist_add(struct pcimax_hist *hist, int64_t ms)
+{
+	size_t i;
+
+	for (i = 0; i < PCIMAX_HIST_BUCKETS; i++) {
+		if (ms <= pcimax_hist_bounds[i])
+			break;
 	}
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum_ms += ms;
+}
 
-	/* create a watch descriptor for the config file, sensitive to
-	 * file modifications */
-	watch_fd = inotify_add_watch(notify_fd, settings->file, IN_MODIFY);
-	if (watch_fd == -1) {
-		fprintf(stderr, "Error adding config file to watch list\n");
-		return;
+/* counts a sent command by its mnemonic */
+static void pcimax_metrics_cmd(struct pcimax_metrics *metrics,
+			       const struct pcimax_frame *frame)
+{
+	char cmd[PCIMAX_CMD_MAX + 1];
+	size_t i;
+
+	pcimax_frame_cmd(frame, cmd);
+	for (i = 0; i < metrics->cmd_count; i++) {
+		if (strcmp(metrics->cmds[i].cmd, cmd) == 0)
+			break;
 	}
-	
-	/* read loop */
-	while (true) {
-		printf("\n Monitoring config file for changes\n");
-		printf("End program with ctrl+c\n"); 
-
-		/* wait for file modifications */
-		memset(buffer, 0, BUF_LEN);
-		rd_cnt = read(notify_fd, buffer, BUF_LEN);
-		if (rd_cnt <= 0) {
-			fprintf(stderr, "Error reading from monitored config file\n");
+	if (i == metrics->cmd_count) {
+		if (i >= PCIMAX_METRIC_CMDS)
 			return;
-		}
+		strcpy(metrics->cmds[i].cmd, cmd);
+		metrics->cmd_count++;
+	}
+	metrics->cmds[i].count++;
+}
+
+/* drops all queued commands of the settings in @fields */
+static void pcimax_sched_drop(struct pcimax_sched *sched, uint32_t fields)
+{
+	struct pcimax_queue *queue;
+	size_t kept;
 
-		/* file was modified */
-		ini_parse(settings->file, pcimax_ini_cb, settings);
-		/* update all defined RDS values */
-		if (settings->defined & PCIMAX_FM)
-			pcimax_set_fm_settings(fd, settings);
-		if (settings->defined & PCIMAX_RDS)
-			pcimax_set_rds_settings(fd, settings);
+	for (int prio = 0; prio < PCIMAX_PRIO_COUNT; prio++) {
+		queue = &sched->queues[prio];
+		kept = 0;
+		for (size_t i = queue->head; i < queue->head + queue->count; i++) {
+			if (queue->entries[i].frame.field & fields)
+				continue;
+			queue->entries[kept++] = queue->entries[i];
+		}
+		queue->head = 0;
+		queue->count = kept;
+	}
+	for (int bit = 0; bit < 32; bit++) {
+		if (fields & (1u << bit)) {
+			sched->pending[bit] = 0;
+			sched->gen[bit]++;
+		}
 	}
 }
 
-int main(int argc, char* argv[])
+/* takes a card out of service after an error, the other cards are not
+ * affected
+ * @what:	description of the failed operation, errno holds the cause */
+static void pcimax_card_fail(struct pcimax_card *card, const char *what)
 {
-	static struct pcimax_settings settings;
-	memset(&settings, 0, sizeof(settings));
+	snprintf(card->error, sizeof(card->error), "%s: %s", what, strerror(errno));
+	fprintf(stderr, "Card %s at %s failed, %s\n", card->key, card->device,
+		card->error);
+	/* closing the fds removes them from the main loop, a pending
+	 * expiry of the pacing timer goes with it */
+	if (card->fd >= 0)
+		close(card->fd);
+	card->fd = -1;
+	if (card->timer_fd >= 0)
+		close(card->timer_fd);
+	card->timer_fd = -1;
+	pcimax_sched_drop(&card->sched, ~0u);
+	card->sched.state = PCIMAX_SCHED_IDLE;
+	card->sched.sent = 0;
+	card->failed = true;
+}
 
-	/* register signal handler for interrupt signal, to exit gracefully */
-	signal(SIGINT, signal_handler_interrupt);
+/* queues all commands of the plan according to their priority, commands
+ * of the same settings that are still waiting are superseded
+ * @settings:	settings the plan was generated from
+ * @mask:	bitmask of the settings in the plan
+ * @replay:	sort the commands by their replay priority */
+static void pcimax_sched_add(struct pcimax_card *card,
+			     const struct pcimax_plan *plan,
+			     const struct pcimax_values *settings,
+			     uint32_t mask,
+			     bool replay)
+{
+	struct pcimax_sched *sched = &card->sched;
+	struct pcimax_state *shadow = card->shadow;
+	const struct pcimax_frame *frame;
+	struct pcimax_queue *queue;
+	uint32_t fields = 0;
+	uint32_t writing = 0;
+	int64_t now = pcimax_now_ms();
 
-	/* set up the program settings */
-	pcimax_parse_cl(argc, argv, &settings);
+	for (size_t i = 0; i < plan->count; i++)
+		fields |= plan->frames[i].field;
+	/* commands that are being written change the card state once more */
+	if (sched->state == PCIMAX_SCHED_WRITING) {
+		for (size_t i = 0; i < sched->batch_count; i++)
+			writing |= sched->batch[i].frame.field;
+	}
+	pcimax_sched_drop(sched, fields);
+	pcimax_values_copy(&sched->target, settings, mask);
+	pcimax_journal_start(card, fields, settings);
 
-	/* if a ini file was specified, load the values from the file */
-	if (settings.options[OptFile]) {
-		ini_parse(settings.file, pcimax_ini_cb, &settings);
+	for (size_t i = 0; i < plan->count; i++) {
+		frame = &plan->frames[i];
+		queue = &sched->queues[pcimax_field_priority(frame->field, replay)];
+		/* move the waiting entries to the front, if the end of the
+		 * queue is reached */
+		if (queue->head + queue->count >= PCIMAX_QUEUE_MAX) {
+			memmove(queue->entries, &queue->entries[queue->head],
+				queue->count * sizeof(queue->entries[0]));
+			queue->head = 0;
+		}
+		if (queue->count >= PCIMAX_QUEUE_MAX) {
+			fprintf(stderr, "Command queue full, command dropped\n");
+			continue;
+		}
+		queue->entries[queue->head + queue->count].frame = *frame;
+		queue->entries[queue->head + queue->count].queued_ms = now;
+		queue->entries[queue->head + queue->count].gen =
+			sched->gen[__builtin_ctz(frame->field)];
+		queue->count++;
+		sched->pending[__builtin_ctz(frame->field)]++;
 	}
 
-	/* if no device was specified, try to auto-detect the card */
-	if (!settings.options[OptSetDevice]) {
-		strncpy(settings.device, pcimax_find_device(), 80);
+	if (!shadow)
+		return;
+	/* the card state of the queued settings is unknown until all
+	 * commands were sent, the settings without commands (see
+	 * pcimax_plan_optimize) are already on the card */
+	shadow->committed.defined &= ~fields;
+	for (uint32_t rest = mask & ~fields; rest; rest &= rest - 1) {
+		if (sched->pending[__builtin_ctz(rest)] || (rest & -rest & writing))
+			shadow->committed.defined &= ~(rest & -rest);
+		else
+			shadow->committed.defined |= rest & -rest;
 	}
+	pcimax_values_copy(&shadow->committed, settings, mask & ~fields);
+	msync(shadow, sizeof(*shadow), MS_SYNC);
+}
 
-	/* open the device(com port) and configure it */
-	fd = pcimax_open_serial(settings.device);
-	pcimax_setup_serial(fd);
+/* removes the next command from the queue of the highest priority class
+ * @prio:	set to the priority class of the command
+ * @ret_val:	false if no commands are waiting */
+static bool pcimax_sched_next(struct pcimax_sched *sched,
+			      struct pcimax_queued *next, int *prio)
+{
+	struct pcimax_queue *queue;
 
-	/* update all defined RDS values */
-	if (settings.defined & PCIMAX_FM)
-		pcimax_set_fm_settings(fd, &settings);
-	if (settings.defined & PCIMAX_RDS)
-		pcimax_set_rds_settings(fd, &settings);
+	for (*prio = 0; *prio < PCIMAX_PRIO_COUNT; (*prio)++) {
+		queue = &sched->queues[*prio];
+		if (!queue->count)
+			continue;
+		*next = queue->entries[queue->head++];
+		queue->count--;
+		return true;
+	}
+	return false;
+}
+
+/* bookkeeping after a command was written to the card, once all commands
+ * of a setting are sent, its value is committed to the state file
+ * @queued:	the command that was sent
+ * @prio:	its priority class */
+static void pcimax_sched_sent(struct pcimax_card *card,
+			      const struct pcimax_queued *queued, int prio)
+{
+	struct pcimax_sched *sched = &card->sched;
+	struct pcimax_state *shadow = card->shadow;
+	uint32_t field = queued->frame.field;
+	int64_t delay = pcimax_now_ms() - queued->queued_ms;
+	char cmd[PCIMAX_CMD_MAX + 1];
+
+	sched->sent++;
+	if (delay > sched->max_delay)
+		sched->max_delay = delay;
+	pcimax_metrics_cmd(&card->metrics, &queued->frame);
+	pcimax_hist_add(&card->metrics.queue_delay, delay);
+	if (verbose) {
+		pcimax_frame_cmd(&queued->frame, cmd);
+		pcimax_card_prefix(card);
+		printf("  sent %-4s (%s), %lld ms in queue\n", cmd,
+		       pcimax_priority_names[prio], (long long)delay);
+	}
+
+	/* the latency of a TA trigger, including the transmission of the
+	 * frame */
+	if (card->ta_trigger_us && (field & PCIMAX_TA)) {
+		pcimax_card_prefix(card);
+		printf("TA %s: on the wire %.1f ms after the trigger\n",
+		       sched->target.ta == '1' ? "on" : "off",
+		       (pcimax_now_us() - card->ta_trigger_us +
+			pcimax_wire_us(queued->frame.len)) / 1000.0);
+		card->ta_trigger_us = 0;
+	}
+
+	/* superseded while it was written, the newer commands commit */
+	if (queued->gen != sched->gen[__builtin_ctz(field)])
+		return;
+	if (--sched->pending[__builtin_ctz(field)])
+		return;
+	pcimax_journal_finish(card, field);
+	if (!shadow)
+		return;
+	pcimax_values_copy(&shadow->committed, &sched->target, field);
+	shadow->committed.defined |= field;
+	msync(shadow, sizeof(*shadow), MS_ASYNC);
+}
+
+/* returns true if no commands are waiting to be sent */
+static bool pcimax_sched_empty(const struct pcimax_sched *sched)
+{
+	for (int prio = 0; prio < PCIMAX_PRIO_COUNT; prio++) {
+		if (sched->queues[prio].count)
+			return false;
+	}
+	return true;
+}
+
+static void pcimax_sched_kick(struct pcimax_card *card);
+static void pcimax_metrics_save(void);
+static bool pcimax_metrics_write(int fd);
+
+/* continues writing the current batch of commands, once it is written
+ * completely the card gets time to process it. There has to be a delay
+ * after every command, it ends early when the card answers (see
+ * pcimax_sched_answer), the configured delay is only used as an upper
+ * bound for cards that don't answer at all */
+static void pcimax_sched_write(struct pcimax_card *card)
+{
+	struct pcimax_sched *sched = &card->sched;
+	struct pcimax_metrics *metrics = &card->metrics;
+	size_t left = 0;
+	size_t bytes = 0;
+	int64_t now;
+	int ret;
+
+	for (int i = 0; i < sched->iov_left; i++)
+		left += sched->iov_next[i].iov_len;
+	ret = pcimax_write_iov(card->fd, &sched->iov_next, &sched->iov_left);
+	for (int i = 0; i < sched->iov_left; i++)
+		left -= sched->iov_next[i].iov_len;
+	metrics->bytes += left;
+	if (ret < 0) {
+		metrics->write_errors++;
+		errno = -ret;
+		pcimax_card_fail(card, "write error");
+		return;
+	}
+	if (ret == 0) {
+		metrics->partial_writes++;
+		pcimax_serial_watch_out(card, true);
+		return;
+	}
+	now = pcimax_now_us();
+	metrics->write_us += now - metrics->phase_us;
+	metrics->phase_us = now;
+	if (sched->state == PCIMAX_SCHED_WRITING)
+		pcimax_serial_watch_out(card, false);
+	for (size_t i = 0; i < sched->batch_count; i++) {
+		pcimax_sched_sent(card, &sched->batch[i], sched->batch_prio[i]);
+		bytes += sched->batch[i].frame.len;
+	}
+	/* the write returns once the frames are in the tx buffer of the
+	 * kernel, the card can't see them before they're on the wire. The
+	 * delay and the answer window start after the transmission */
+	sched->cmd_start = (now + pcimax_wire_us(bytes) + 999) / 1000;
+
+	if (cmd_delay == 0) {
+		pcimax_startup_report();
+		pcimax_journal_confirm(card);
+		sched->state = PCIMAX_SCHED_IDLE;
+		pcimax_sched_kick(card);
+		return;
+	}
+	sched->state = PCIMAX_SCHED_WAITING;
+	pcimax_timer_arm(card->timer_fd, sched->cmd_start + sched->wait_max);
+}
+
+/* sends the next queued commands to the card, highest priority first
+ * every frame goes out with a single write, unless the delay was disabled
+ * (--delay=0), in that case all queued commands are submitted at once with
+ * writev. New requests that are queued while the card processes a command
+ * preempt lower priority commands at the next command boundary */
+static void pcimax_sched_kick(struct pcimax_card *card)
+{
+	struct pcimax_sched *sched = &card->sched;
+	size_t max = (cmd_delay == 0) ? PCIMAX_BATCH_MAX : 1;
+	int64_t elapsed;
+
+	if (sched->state != PCIMAX_SCHED_IDLE || card->failed)
+		return;
+
+	sched->batch_count = 0;
+	while (sched->batch_count < max &&
+	       pcimax_sched_next(sched, &sched->batch[sched->batch_count],
+				 &sched->batch_prio[sched->batch_count])) {
+		sched->iov[sched->batch_count].iov_base =
+			sched->batch[sched->batch_count].frame.buf;
+		sched->iov[sched->batch_count].iov_len =
+			sched->batch[sched->batch_count].frame.len;
+		sched->batch_count++;
+	}
+	if (!sched->batch_count) {
+		/* all commands sent */
+		if (sched->sent) {
+			elapsed = pcimax_now_ms() - sched->run_start;
+			card->total_sent += sched->sent;
+			card->busy_ms += elapsed;
+			pcimax_hist_add(&card->metrics.apply, elapsed);
+			pcimax_card_prefix(card);
+			printf("Sent %u commands in %lld ms, max queueing delay %lld ms\n",
+			       sched->sent, (long long)elapsed,
+			       (long long)sched->max_delay);
+			/* idle kicks don't change the counters */
+			pcimax_metrics_save();
+		}
+		sched->sent = 0;
+		return;
+	}
+	if (!sched->sent) {
+		sched->run_start = pcimax_now_ms();
+		sched->max_delay = 0;
+	}
+
+	/* discard stale input, so that only the answer to this command
+	 * releases the next one */
+	tcflush(card->fd, TCIFLUSH);
+	sched->wait_max = pcimax_card_delay(card, &sched->batch[0].frame);
+	card->metrics.phase_us = pcimax_now_us();
+	sched->iov_next = sched->iov;
+	sched->iov_left = sched->batch_count;
+	sched->state = PCIMAX_SCHED_WRITING;
+	pcimax_sched_write(card);
+}
+
+/* reads what the card echoes / acknowledges. The card is considered ready
+ * as soon as its answer is complete, i.e. no further bytes arrive for
+ * PCIMAX_QUIET_MS */
+static void pcimax_sched_answer(struct pcimax_card *card)
+{
+	struct pcimax_sched *sched = &card->sched;
+	char buffer[64];
+	int64_t ready;
+
+	while (read(card->fd, buffer, sizeof(buffer)) > 0) {
+		if (sched->state != PCIMAX_SCHED_WAITING)
+			continue;
+		ready = pcimax_now_ms() + PCIMAX_QUIET_MS;
+		if (ready < sched->cmd_start + sched->wait_max)
+			pcimax_timer_arm(card->timer_fd, ready);
+	}
+}
+
+/* the card is ready for the next command */
+static void pcimax_sched_timeout(struct pcimax_card *card)
+{
+	uint64_t expirations;
+
+	if (read(card->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	if (card->sched.state != PCIMAX_SCHED_WAITING)
+		return;
+	pcimax_startup_report();
+	card->metrics.wait_us += pcimax_now_us() - card->metrics.phase_us;
+	/* the card answered or had the time to process the commands */
+	pcimax_journal_confirm(card);
+	card->sched.state = PCIMAX_SCHED_IDLE;
+	pcimax_sched_kick(card);
+}
+
+/* @ret_val:	directory holding the state files */
+static const char *pcimax_state_dir(const struct pcimax_settings *settings)
+{
+	return settings->options[OptStateDir] ? settings->state_dir : PCIMAX_STATE_DIR;
+}
+
+/* opens (or creates) a file of a card in the state directory and maps it
+ * into memory
+ * @dir:	directory that holds the state files
+ * @key:	unique name of the card (USB serial or device path)
+ * @suffix:	kind of the file, e.g. "state"
+ * @readonly:	an existing file is mapped privately, changes of the mapping
+ *		don't reach the file and nothing is created (dry run)
+ * @ret_val:	mapped file, NULL if the file can't be used */
+static void *pcimax_state_map(const char *dir, const char *key,
+			      const char *suffix, size_t size, bool readonly)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s.%s", dir, key, suffix);
+	if (readonly) {
+		/* a missing or truncated file holds nothing */
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return NULL;
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < size) {
+			close(fd);
+			return NULL;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		return (map == MAP_FAILED) ? NULL : map;
+	}
+	mkdir(dir, 0755);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		fprintf(stderr, "Unable to open %s file %s", suffix, path);
+		perror(": ");
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s file %s", suffix, path);
+		perror(": ");
+		return NULL;
+	}
+	return map;
+}
+
+/* opens (or creates) the state file of a card and maps it into memory
+ * @readonly:	see pcimax_state_map
+ * @ret_val:	mapped state, NULL if the state file can't be used */
+static struct pcimax_state *pcimax_state_open(const char *dir, const char *key,
+					      bool readonly)
+{
+	struct pcimax_state *state;
+
+	state = pcimax_state_map(dir, key, "state", sizeof(*state), readonly);
+	if (!state)
+		return NULL;
+
+	/* new file or written by an incompatible version -> nothing known */
+	if (state->magic != PCIMAX_STATE_MAGIC ||
+	    state->version != PCIMAX_STATE_VERSION ||
+	    state->size != sizeof(state->committed)) {
+		memset(state, 0, sizeof(*state));
+		state->magic = PCIMAX_STATE_MAGIC;
+		state->version = PCIMAX_STATE_VERSION;
+		state->size = sizeof(state->committed);
+		msync(state, sizeof(*state), MS_SYNC);
+	}
+	return state;
+}
+
+/* opens (or creates) the journal of a card and maps it into memory
+ * @readonly:	see pcimax_state_map
+ * @ret_val:	mapped journal, NULL if the journal can't be used */
+static struct pcimax_journal *pcimax_journal_open(const char *dir,
+						  const char *key,
+						  bool readonly)
+{
+	struct pcimax_journal *journal;
+
+	journal = pcimax_state_map(dir, key, "journal", sizeof(*journal),
+				   readonly);
+	if (!journal)
+		return NULL;
+
+	/* new file or written by an incompatible version -> no progress */
+	if (journal->magic != PCIMAX_JOURNAL_MAGIC ||
+	    journal->version != PCIMAX_JOURNAL_VERSION ||
+	    journal->size != sizeof(journal->target)) {
+		memset(journal, 0, sizeof(*journal));
+		journal->magic = PCIMAX_JOURNAL_MAGIC;
+		journal->version = PCIMAX_JOURNAL_VERSION;
+		journal->size = sizeof(journal->target);
+		msync(journal, sizeof(*journal), MS_SYNC);
+	}
+	return journal;
+}
+
+/* FNV-1a hash of a command frame */
+static uint32_t pcimax_frame_hash(const struct pcimax_frame *frame)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint8_t i = 0; i < frame->len; i++) {
+		hash ^= (uint8_t)frame->buf[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* removes the confirmed commands of the settings in @fields */
+static void pcimax_journal_drop(struct pcimax_journal *journal, uint32_t fields)
+{
+	uint32_t kept = 0;
+
+	for (uint32_t i = 0; i < journal->count; i++) {
+		if (!(journal->done[i].field & fields))
+			journal->done[kept++] = journal->done[i];
+	}
+	journal->count = kept;
+	journal->fields &= ~fields;
+}
+
+/* records that the commands of the settings in @fields are queued, the
+ * progress of a setting is kept if it is queued with the same value again
+ * @settings:	values of the settings */
+static void pcimax_journal_start(struct pcimax_card *card, uint32_t fields,
+				 const struct pcimax_values *settings)
+{
+	struct pcimax_journal *journal = card->journal;
+
+	if (!journal)
+		return;
+	for (uint32_t rest = fields; rest; rest &= rest - 1) {
+		uint32_t bit = rest & -rest;
+
+		if (!(journal->fields & bit) ||
+		    !pcimax_values_equal(&journal->target, settings, bit))
+			pcimax_journal_drop(journal, bit);
+	}
+	pcimax_values_copy(&journal->target, settings, fields);
+	journal->fields |= fields;
+	msync(journal, sizeof(*journal), MS_ASYNC);
+}
+
+/* records the commands of the last batch as confirmed by the card */
+static void pcimax_journal_confirm(struct pcimax_card *card)
+{
+	struct pcimax_journal *journal = card->journal;
+	struct pcimax_sched *sched = &card->sched;
+	const struct pcimax_frame *frame;
+
+	if (!journal)
+		return;
+	for (size_t i = 0; i < sched->batch_count; i++) {
+		frame = &sched->batch[i].frame;
+		/* settings that are complete already, or more commands than
+		 * fit -> they're sent again on resume */
+		if (!(journal->fields & frame->field) ||
+		    journal->count >= PCIMAX_JOURNAL_MAX)
+			continue;
+		journal->done[journal->count].field = frame->field;
+		journal->done[journal->count].hash = pcimax_frame_hash(frame);
+		journal->count++;
+	}
+	msync(journal, sizeof(*journal), MS_ASYNC);
+}
+
+/* all commands of a setting were sent, its progress isn't needed anymore */
+static void pcimax_journal_finish(struct pcimax_card *card, uint32_t field)
+{
+	if (!card->journal)
+		return;
+	pcimax_journal_drop(card->journal, field);
+	msync(card->journal, sizeof(*card->journal), MS_ASYNC);
+}
+
+/* removes the commands from a plan that the card confirmed during an
+ * update that was interrupted, as long as the settings still have the
+ * values of that update */
+static void pcimax_journal_resume(const struct pcimax_card *card,
+				  struct pcimax_plan *plan)
+{
+	const struct pcimax_journal *journal = card->journal;
+	const struct pcimax_frame *frame;
+	uint32_t hash;
+	size_t kept = 0;
+	bool done;
+
+	if (!journal || !journal->count)
+		return;
+	for (size_t i = 0; i < plan->count; i++) {
+		frame = &plan->frames[i];
+		done = false;
+		if ((journal->fields & frame->field) &&
+		    pcimax_values_equal(&journal->target, &card->settings,
+					frame->field)) {
+			hash = pcimax_frame_hash(frame);
+			for (uint32_t j = 0; j < journal->count && !done; j++)
+				done = journal->done[j].field == frame->field &&
+				       journal->done[j].hash == hash;
+		}
+		if (!done)
+			plan->frames[kept++] = *frame;
+	}
+	if (kept < plan->count) {
+		pcimax_card_prefix(card);
+		printf("Resuming, %zu commands were sent before\n",
+		       plan->count - kept);
+	}
+	plan->count = kept;
+}
+
+/* the state of the card is unknown, nothing is known to be committed and
+ * the progress of an interrupted update is void */
+static void pcimax_state_forget(struct pcimax_card *card)
+{
+	if (card->shadow) {
+		card->shadow->committed.defined = 0;
+		msync(card->shadow, sizeof(*card->shadow), MS_SYNC);
+	}
+	if (card->journal) {
+		pcimax_journal_drop(card->journal, ~0u);
+		msync(card->journal, sizeof(*card->journal), MS_SYNC);
+	}
+}
+
+/* prints the descriptions of the values that are encoded into a plan */
+static void pcimax_print_note(const char *text)
+{
+	fputs(text, stdout);
+}
+
+/* collects the commands for the requested FM and RDS settings of the card
+ * and removes the ones that are not needed
+ * @mask:	bitmask of the settings that will be sent to the card
+ * @known:	settings the card is known to have, NULL if unknown */
+static void pcimax_plan_build(const struct pcimax_card *card, uint32_t mask,
+			      const struct pcimax_values *known,
+			      struct pcimax_plan *plan)
+{
+	pcimax_plan_init(plan, pcimax_print_note);
+	pcimax_plan_fm(plan, &card->settings, mask);
+	pcimax_plan_rds(plan, &card->settings, mask);
+	pcimax_plan_optimize(plan, &card->settings, known);
+	/* nothing is skipped if the card state isn't trusted */
+	if (known)
+		pcimax_journal_resume(card, plan);
+}
+
+/* collects the commands for all requested FM and RDS settings of the card
+ * and queues them, they're sent by the main loop
+ * @mask:	bitmask of the settings that will be sent to the card
+ * @replay:	sort the commands by their replay priority */
+static void pcimax_queue(struct pcimax_card *card, uint32_t mask, bool replay)
+{
+	struct pcimax_plan plan;
+
+	if (card->failed || !mask)
+		return;
+	if (card_count > 1)
+		printf("Card %s at %s:\n", card->key, card->device);
+	pcimax_plan_build(card, mask,
+			  card->shadow ? &card->shadow->committed : NULL, &plan);
+	pcimax_sched_add(card, &plan, &card->settings, mask, replay);
+
+	/* if the commands are requested while other commands are being
+	 * sent, they're picked up once the card is ready */
+	pcimax_sched_kick(card);
+}
+
+/* sends the requested settings to the card
+ * @mask:	bitmask of the settings that will be sent to the card */
+static void pcimax_card_apply(struct pcimax_card *card, uint32_t mask)
+{
+	pcimax_queue(card, mask, false);
+}
+
+/* sends all settings to a card whose state is unknown, e.g. after it was
+ * reconnected, ordered by what gets the card back on air the fastest */
+static void pcimax_replay(struct pcimax_card *card)
+{
+	pcimax_state_forget(card);
+	pcimax_queue(card, card->settings.defined, true);
+}
+
+/* loads the calibrated delays of a card (<key>.timing in the state
+ * directory), a missing profile leaves the delays at --delay */
+static void pcimax_timing_load(struct pcimax_card *card, const char *dir)
+{
+	char path[PATH_MAX];
+	char name[16];
+	unsigned int delay;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s.timing", dir, card->key);
+	file = fopen(path, "r");
+	if (!file)
+		return;
+	while (fscanf(file, "%15s %u", name, &delay) == 2) {
+		for (int cls = 0; cls < PCIMAX_CLASS_COUNT; cls++) {
+			if (strcmp(name, pcimax_class_names[cls]) == 0)
+				card->timing[cls] = delay;
+		}
+	}
+	fclose(file);
+	if (verbose) {
+		pcimax_card_prefix(card);
+		printf("Using timing profile %s\n", path);
+	}
+}
+
+/* stores the calibrated delays of a card
+ * @ret_val:	false on error */
+static bool pcimax_timing_save(const struct pcimax_card *card, const char *dir)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+	FILE *file;
+
+	mkdir(dir, 0755);
+	snprintf(path, sizeof(path), "%s/%s.timing", dir, card->key);
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	file = fopen(tmp, "w");
+	if (!file) {
+		fprintf(stderr, "Unable to write timing profile %s", path);
+		perror(": ");
+		return false;
+	}
+	for (int cls = 0; cls < PCIMAX_CLASS_COUNT; cls++) {
+		if (card->timing[cls])
+			fprintf(file, "%s %u\n", pcimax_class_names[cls],
+				card->timing[cls]);
+	}
+	if (fclose(file) || rename(tmp, path)) {
+		fprintf(stderr, "Unable to write timing profile %s", path);
+		perror(": ");
+		unlink(tmp);
+		return false;
+	}
+	printf("Timing profile stored in %s\n", path);
+	return true;
+}
+
+/* reads what the card sends until @deadline (monotonic ms), SIGINT /
+ * SIGTERM end the calibration (loop.stop), the other signals are ignored
+ * @ret_val:	true if the card sent anything */
+static bool pcimax_calibrate_read(int fd, int64_t deadline)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = loop.signal_fd, .events = POLLIN },
+	};
+	struct signalfd_siginfo info;
+	bool answered = false;
+	char buffer[64];
+	int64_t now;
+
+	while (!loop.stop && (now = pcimax_now_ms()) < deadline) {
+		if (poll(pfd, 2, (int)(deadline - now)) <= 0)
+			continue;
+		while (read(loop.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+			if (info.ssi_signo != SIGINT && info.ssi_signo != SIGTERM)
+				continue;
+			fprintf(stderr, "Interrupt received: Terminating program\n");
+			loop.stop = true;
+		}
+		while (read(fd, buffer, sizeof(buffer)) > 0)
+			answered = true;
+	}
+	return answered;
+}
+
+/* runs the verification command of the calibration with the signals
+ * unblocked, so that it can be interrupted like any other command
+ * @ret_val:	true if the command succeeded */
+static bool pcimax_calibrate_verify(const char *hook)
+{
+	char *argv[] = { "sh", "-c", (char *)hook, NULL };
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+	int status;
+	int ret;
+
+	sigemptyset(&mask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (ret) {
+		errno = ret;
+		perror("Unable to run the verification command");
+		return false;
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* sends the probe commands of a class @delay ms apart and checks that the
+ * card kept up: a card that answers has to answer every command before the
+ * next one is sent, otherwise the verification hook decides
+ * @hook:	verification command, empty if unused
+ * @answers:	set to the number of commands the card answered in time
+ * @ret_val:	true if the card took all commands */
+static bool pcimax_calibrate_trial(struct pcimax_card *card,
+				   const struct pcimax_plan *plan,
+				   enum pcimax_cmd_class cls, uint32_t delay,
+				   const char *hook, size_t *answers)
+{
+	size_t sent = 0;
+	char value[16];
+	int64_t start;
+
+	/* let the card finish the previous trial, drop its answers */
+	pcimax_calibrate_read(card->fd, pcimax_now_ms() + cmd_delay);
+	*answers = 0;
+	for (int i = 0; i < PCIMAX_CALIBRATE_REPEAT; i++) {
+		for (size_t f = 0; f < plan->count; f++) {
+			if (pcimax_field_class(plan->frames[f].field) != cls)
+				continue;
+			start = pcimax_now_ms();
+			if (pcimax_frame_write(card->fd, &plan->frames[f]) < 0) {
+				pcimax_card_fail(card, "write error");
+				return false;
+			}
+			sent++;
+			if (pcimax_calibrate_read(card->fd, start + delay))
+				(*answers)++;
+			if (loop.stop)
+				return false;
+		}
+	}
+	if (!hook[0])
+		return *answers == sent;
+
+	pcimax_calibrate_read(card->fd, pcimax_now_ms() + cmd_delay);
+	snprintf(value, sizeof(value), "%u", delay);
+	setenv("PCIMAX_DEVICE", card->device, 1);
+	setenv("PCIMAX_CLASS", pcimax_class_names[cls], 1);
+	setenv("PCIMAX_DELAY", value, 1);
+	return pcimax_calibrate_verify(hook);
+}
+
+/* @ret_val:	settings whose commands are sent during the calibration of a
+ *		class, harmless ones, the configured values are sent */
+static uint32_t pcimax_class_probes(enum pcimax_cmd_class cls)
+{
+	const struct pcimax_key *key;
+	uint32_t mask = 0;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (key->probe && key->cls == cls)
+			mask |= key->bit;
+	}
+	return mask;
+}
+
+/* searches the shortest delay after which the card reliably takes the next
+ * command, separately for every command class. The delay is halved while
+ * the card keeps up, starting at --delay, the stored delay gets a margin
+ * of 25%
+ * @hook:	verification command for cards that don't answer
+ * @ret_val:	false if the card couldn't be calibrated */
+static bool pcimax_calibrate(struct pcimax_card *card, const char *hook)
+{
+	struct pcimax_plan plan;
+	uint32_t mask;
+	uint32_t low, high, mid;
+	size_t answers;
+	bool ok;
+
+	if (!cmd_delay) {
+		fprintf(stderr, "Calibration needs a delay to start from (--delay)\n");
+		return false;
+	}
+	if (card_count > 1)
+		printf("Card %s at %s:\n", card->key, card->device);
+	for (int cls = 0; cls < PCIMAX_CLASS_COUNT; cls++) {
+		mask = pcimax_class_probes(cls) & card->settings.defined;
+		if (!mask) {
+			printf("Calibrating %s commands: no %s settings configured, "
+			       "skipped\n", pcimax_class_names[cls],
+			       pcimax_class_names[cls]);
+			continue;
+		}
+		pcimax_plan_init(&plan, pcimax_print_note);
+		pcimax_plan_fm(&plan, &card->settings, mask);
+		pcimax_plan_rds(&plan, &card->settings, mask);
+
+		/* the full delay has to work, otherwise nothing is known */
+		high = cmd_delay;
+		ok = pcimax_calibrate_trial(card, &plan, cls, high, hook, &answers);
+		if (card->failed || loop.stop)
+			return false;
+		if (!ok && !answers && !hook[0]) {
+			fprintf(stderr, "The card doesn't answer, calibration "
+				"needs a verification command (--verify)\n");
+			return false;
+		}
+		if (!ok) {
+			fprintf(stderr, "Calibrating %s commands: the card fails "
+				"at %u ms already, not calibrated\n",
+				pcimax_class_names[cls], high);
+			continue;
+		}
+		low = 0;
+		while (high - low > PCIMAX_CALIBRATE_STEP) {
+			mid = (low + high) / 2;
+			ok = pcimax_calibrate_trial(card, &plan, cls, mid, hook,
+						    &answers);
+			if (card->failed || loop.stop)
+				return false;
+			if (verbose)
+				printf("  %s commands at %u ms: %s\n",
+				       pcimax_class_names[cls], mid,
+				       ok ? "ok" : "failed");
+			if (ok)
+				high = mid;
+			else
+				low = mid;
+		}
+		/* margin for a busier card */
+		card->timing[cls] = high + high / 4 + 1;
+		if (card->timing[cls] > cmd_delay)
+			card->timing[cls] = cmd_delay;
+		printf("Calibrating %s commands: works at %u ms, using %u ms\n",
+		       pcimax_class_names[cls], high, card->timing[cls]);
+	}
+	return true;
+}
+
+/* @ret_val:	the setting of a --set-<name> option, NULL if @option is
+ *		not one of them */
+static const struct pcimax_key *pcimax_option_key(int option)
+{
+	const struct pcimax_key *key;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (!key->arg)
+			continue;
+		if (option == OptSetKey + (key - pcimax_keys) ||
+		    (key->opt && option == key->opt))
+			return key;
+	}
+	return NULL;
+}
+
+/* prints the --set-<name> options of the settings of a config file
+ * section */
+static void pcimax_usage_keys(const char *section)
+{
+	const struct pcimax_key *key;
+	const char *line;
+	int len;
+
+	for (key = pcimax_keys; key->name; key++) {
+		if (!key->arg || strcmp(key->section, section))
+			continue;
+		printf("  --set-%s=%s\n", key->name, key->arg);
+		for (line = key->help; *line; line += len + (line[len] == '\n')) {
+			len = strcspn(line, "\n");
+			printf("%21s%.*s\n", "", len, line);
+		}
+	}
+}
+
+/* callback function for the ini file parsing library
+ * @ret_val:	0 if the setting is unknown or the value is invalid */
+int pcimax_ini_cb(void* buffer, const char* section, const char* name, const char* value)
+{
+	struct pcimax_values *settings = (struct pcimax_values*) buffer;
+	const struct pcimax_key *key = pcimax_find_key(name);
+
+	/* unknown setting */
+	if (!key || strcmp(section, key->section))
+		return 0;
+	return key->parse(settings, key, value);
+}
+
+/* parse the command line into the settings struct */
+uint32_t pcimax_parse_cl(int argc, char **argv,
+			struct pcimax_settings *settings)
+{
+	static char set_names[OptLast - OptSetKey][32];
+	struct option options[sizeof(long_options) / sizeof(long_options[0]) +
+			      OptLast - OptSetKey];
+	const struct pcimax_key *key;
+	int count = 0;
+	int i = 0;
+	int idx = 0;
+	int ch = 0;
+	/* 26 letters in the alphabet, case sensitive = 26 * 2 possible
+	 * short options, where each option requires at most two chars
+	 * {option, optional argument} */
+	char short_options[26 * 2 * 2 + 1];
+
+	if (argc == 1) {
+		pcimax_usage_hint();
+		exit(1);
+	}
+	/* the general options and a --set-<name> option per setting */
+	for (i = 0; long_options[i].name; i++)
+		options[count++] = long_options[i];
+	for (key = pcimax_keys; key->name; key++) {
+		size_t j = key - pcimax_keys;
+
+		if (!key->arg)
+			continue;
+		snprintf(set_names[j], sizeof(set_names[0]), "set-%s", key->name);
+		options[count++] = (struct option){ set_names[j],
+						    required_argument, 0,
+						    key->opt ? key->opt :
+						    OptSetKey + (int)j };
+	}
+	options[count] = (struct option){ 0, 0, 0, 0 };
+
+	/* parse command line options */
+	for (i = 0; options[i].name; i++) {
+		if (!isalpha(options[i].val))
+			continue;
+		short_options[idx++] = options[i].val;
+		if (options[i].has_arg == required_argument)
+			short_options[idx++] = ':';
+	}
+
+	while(1){
+		int option_index = 0;
+
+		short_options[idx] = 0;
+		ch = getopt_long(argc, argv, short_options,
+				 options, &option_index);
+		if (ch == -1)
+			break;
+
+		settings->options[(int)ch] = 1;
+		switch (ch){
+		case OptFile:
+			if (access(optarg, F_OK) != -1)
+				strncpy(settings->file, optarg, 80);
+			else {
+				fprintf(stderr, "Unable to open ini file: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OptVerbose:
+			verbose = true;
+			break;
+		case OptDelay:
+			settings->delay = strtoul(optarg, NULL, 10);
+			break;
+		case OptDebounce:
+			settings->debounce = strtoul(optarg, NULL, 10);
+			break;
+		case OptStateDir:
+			strncpy(settings->state_dir, optarg, 79);
+			break;
+		case OptSocket:
+			strncpy(settings->socket, optarg, 79);
+			break;
+		case OptMetrics:
+			strncpy(settings->metrics, optarg, 79);
+			break;
+		case OptProfile:
+			strncpy(settings->profile, optarg, 79);
+			break;
+		case OptFeed:
+			strncpy(settings->feed, optarg, 79);
+			break;
+		case OptBatch:
+			strncpy(settings->batch, optarg, 79);
+			break;
+		case OptVerify:
+			strncpy(settings->verify, optarg, 255);
+			break;
+		case OptGet:
+			strncpy(settings->get, optarg, 79);
+			break;
+		case OptSetDevice:
+			memset(settings->device, 0, 80);
+			if (access(optarg, F_OK) != -1) {
+				strncpy(settings->device, optarg, 80);
+				/* every given device is controlled */
+				pcimax_card_add(optarg, NULL);
+			} else {
+				fprintf(stderr, "Unable to open device: %s\n", optarg);
+				exit(1);
+			}
+			break; 
+		case OptHelp:
+			pcimax_usage();
+			pcimax_usage_fm();
+			pcimax_usage_rds();
+			exit(1);
+			break;
+		case ':':
+			fprintf(stderr, "Option '%s' requires a value\n",
+				argv[optind]);
+			pcimax_usage_hint();
+			exit(1);
+		case '?':
+			if (argv[optind])
+				fprintf(stderr, "Unknown argument '%s'\n", argv[optind]);
+			pcimax_usage_hint();
+			exit(1);
+		default:
+			key = pcimax_option_key(ch);
+			if (key && !key->parse(&settings->values, key, optarg)) {
+				fprintf(stderr, "Invalid value for --set-%s: %s\n",
+					key->name, optarg);
+				exit(1);
+			}
+		}
+	}
+	if (optind < argc) {
+		printf("unknown arguments: ");
+		while (optind < argc)
+			printf("%s ", argv[optind++]);
+		printf("\n");
+		pcimax_usage_hint();
+		return 1;
+	}
+	if (settings->options[OptFeed] && settings->options[OptBatch] &&
+	    strcmp(settings->feed, "-") == 0 && strcmp(settings->batch, "-") == 0) {
+		fprintf(stderr, "--feed and --batch can't both read stdin\n");
+		exit(1);
+	}
+
+	return 0;
+}
+
+/* settings of a card that are parsed from the config file */
+struct pcimax_card_ini {
+	const struct pcimax_card *card;
+	struct pcimax_values *settings;
+};
+
+/* callback function for the ini file parsing library, applies the settings
+ * of the [card:<id>] sections that belong to the card, where <id> is the
+ * USB serial or the sysfs path of the card (or the path of its tty device),
+ * the section line is limited to 255 characters, longer ones are dropped
+ * with their values, e.g.
+ *   [card:0001]
+ *   freq = 98.5
+ * the sections of other cards and the general sections are skipped
+ * @ret_val:	0 if the setting is unknown or the value is invalid */
+static int pcimax_card_ini_cb(void *buffer, const char *section,
+			      const char *name, const char *value)
+{
+	struct pcimax_card_ini *ini = buffer;
+	const struct pcimax_key *key;
+
+	if (strncmp(section, "card:", 5) ||
+	    !pcimax_card_match(ini->card, section + 5))
+		return 1;
+	key = pcimax_find_key(name);
+	if (!key)
+		return 0;
+	return key->parse(ini->settings, key, value);
+}
+
+/* applies the [card:<id>] sections of the config file to @settings */
+static void pcimax_card_settings(const struct pcimax_card *card,
+				 const char *file,
+				 struct pcimax_values *settings)
+{
+	struct pcimax_card_ini ini = { card, settings };
+
+	ini_parse(file, pcimax_card_ini_cb, &ini);
+}
+
+/* opens the serial line of a card and sets it up for the main loop, with a
+ * fresh pacing timer
+ * @ret_val:	false if the card can't be used */
+static bool pcimax_card_connect(struct pcimax_card *card)
+{
+	uint64_t idx = card - cards;
+
+	card->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (card->timer_fd < 0 ||
+	    !pcimax_loop_add(card->timer_fd, EPOLLIN, PCIMAX_SRC_TIMER | idx << 32)) {
+		pcimax_card_fail(card, "unable to add to the main loop");
+		return false;
+	}
+	card->fd = pcimax_serial_open(card->device, &card->old_settings);
+	if (card->fd < 0) {
+		errno = -card->fd;
+		card->fd = -1;
+		pcimax_card_fail(card, "unable to open the serial line");
+		return false;
+	}
+	if (!pcimax_loop_add(card->fd, EPOLLIN, PCIMAX_SRC_SERIAL | idx << 32)) {
+		pcimax_card_fail(card, "unable to add to the main loop");
+		return false;
+	}
+	card->failed = false;
+	return true;
+}
+
+/* prepares a card for the main loop, loads the settings last committed to
+ * it and connects to it. The card starts from the values of the last
+ * (re)load of the config file and its [card:<id>] section
+ * @base:	options from the command line and the config file
+ * @ret_val:	false if the card can't be used */
+static bool pcimax_card_open(struct pcimax_card *card,
+			     const struct pcimax_settings *base)
+{
+	int profile;
+
+	pcimax_card_identify(card);
+	card->settings = loop.base;
+	if (base->options[OptFile])
+		pcimax_card_settings(card, base->file, &card->settings);
+	/* a card starts in the profile of the other cards, also one that is
+	 * plugged in later */
+	pcimax_profiles_compile(card, &card->settings);
+	profile = pcimax_profile_find(loop.profile);
+	if (profile >= 0) {
+		card->settings = card->profiles[profile].settings;
+		strcpy(card->profile, loop.profile);
+	}
+	pcimax_ta_keep(&card->settings);
+
+	/* load the settings that were last committed to this card, a dry
+	 * run leaves the state directory as it is */
+	card->shadow = pcimax_state_open(pcimax_state_dir(base), card->key,
+					 base->options[OptDryRun]);
+	card->journal = pcimax_journal_open(pcimax_state_dir(base), card->key,
+					    base->options[OptDryRun]);
+	if (!base->options[OptCalibrate])
+		pcimax_timing_load(card, pcimax_state_dir(base));
+	/* a dry run only needs the state, the card isn't touched */
+	if (base->options[OptDryRun])
+		return true;
+	return pcimax_card_connect(card);
+}
+
+/* @ret_val:	bitmask of the settings a card that was just opened needs,
+ *		the ones it doesn't have yet unless @force is set */
+static uint32_t pcimax_card_changes(struct pcimax_card *card, bool force)
+{
+	uint32_t mask = card->settings.defined;
+
+	if (card->shadow && !force) {
+		mask = pcimax_values_diff(&card->shadow->committed,
+					  &card->settings);
+		if (card->settings.defined && !mask) {
+			pcimax_card_prefix(card);
+			printf("Card is already up to date\n");
+		}
+	}
+	/* the card turns the RDS output off when it loses power, which
+	 * the state file can't tell, so it is always enabled again */
+	if (card->settings.defined & PCIMAX_RDS_FIELDS)
+		mask |= PCIMAX_RDS;
+	return mask;
+}
+
+/* sends the settings to a card that was just opened, only the ones the
+ * card doesn't have yet unless @force is set */
+static void pcimax_card_start(struct pcimax_card *card, bool force)
+{
+	uint32_t mask = pcimax_card_changes(card, force);
+
+	/* the card state is not trusted, no AF / DI slot is skipped and
+	 * nothing is resumed */
+	if (force)
+		pcimax_state_forget(card);
+	pcimax_card_apply(card, mask);
+}
+
+/* prints the commands that would be sent to a card that was just opened,
+ * in the order the scheduler sends them: the time they'd start at, the
+ * priority, the command with its decoded value and the raw bytes of the
+ * frame. The totals estimate the time the card is busy, per command class,
+ * and the share of the PS / PD slot sweep. Both use the full delay after
+ * every command, the upper bound, a card that answers is done earlier
+ * @force:	all settings, not only the ones the card doesn't have yet */
+static void pcimax_card_dry_run(struct pcimax_card *card, bool force)
+{
+	uint32_t mask = pcimax_card_changes(card, force);
+	const struct pcimax_frame *frame;
+	struct pcimax_plan plan;
+	char cmd[PCIMAX_CMD_MAX + 1];
+	char value[PCIMAX_VALUE_MAX];
+	struct {
+		size_t count;
+		size_t bytes;
+		uint64_t busy_us;
+	} cls[PCIMAX_CLASS_COUNT] = { { 0 } }, total = { 0 }, sweep = { 0 };
+	uint64_t busy_us;
+	int c;
+
+	if (!mask)
+		return;
+	pcimax_plan_build(card, mask, force || !card->shadow ?
+			  NULL : &card->shadow->committed, &plan);
+	if (card_count > 1)
+		printf("Card %s at %s:\n", card->key, card->device);
+	for (int prio = 0; prio < PCIMAX_PRIO_COUNT; prio++) {
+		for (size_t i = 0; i < plan.count; i++) {
+			frame = &plan.frames[i];
+			if ((int)pcimax_field_priority(frame->field, false) != prio)
+				continue;
+			pcimax_frame_cmd(frame, cmd);
+			pcimax_frame_describe(frame, value);
+			printf("  %7.1f ms  %-10s %-4s %s\n         ",
+			       total.busy_us / 1000.0, pcimax_priority_names[prio],
+			       cmd, value);
+			for (size_t j = 0; j < frame->len; j++)
+				printf(" %02x", (unsigned char)frame->buf[j]);
+			putchar('\n');
+
+			/* the card gets the delay after every command, it
+			 * ends early if the card answers */
+			busy_us = pcimax_wire_us(frame->len) +
+				  pcimax_card_delay(card, frame) * 1000;
+			c = pcimax_field_class(frame->field);
+			cls[c].count++;
+			cls[c].bytes += frame->len;
+			cls[c].busy_us += busy_us;
+			total.count++;
+			total.bytes += frame->len;
+			total.busy_us += busy_us;
+			if (frame->field & PCIMAX_PS_SLOTS) {
+				sweep.count++;
+				sweep.bytes += frame->len;
+				sweep.busy_us += busy_us;
+			}
+		}
+	}
+
+	printf("%zu commands, %zu bytes, %llu ms on the wire at %u baud, "
+	       "busy for at most %llu ms with the delays\n",
+	       total.count, total.bytes,
+	       (unsigned long long)pcimax_wire_us(total.bytes) / 1000,
+	       PCIMAX_BAUD, (unsigned long long)total.busy_us / 1000);
+	for (c = 0; c < PCIMAX_CLASS_COUNT; c++) {
+		if (!cls[c].count)
+			continue;
+		printf("  %-5s %3zu commands, %4zu bytes, %6llu ms\n",
+		       pcimax_class_names[c], cls[c].count, cls[c].bytes,
+		       (unsigned long long)cls[c].busy_us / 1000);
+	}
+	if (sweep.count)
+		printf("the PS / PD slot sweep takes %zu commands, at most %llu ms "
+		       "(%llu%% of the upper bound), it is sent while the slots "
+		       "of the card are unknown\n",
+		       sweep.count, (unsigned long long)sweep.busy_us / 1000,
+		       (unsigned long long)(sweep.busy_us * 100 / total.busy_us));
+}
+
+/* creates an inotify instance watching the directory of the config file,
+ * so that the watch survives editors and tools that save by writing a new
+ * file and renaming it over the old one
+ * @ret_val:	inotify file descriptor, -1 on error */
+static int pcimax_monitor_init(const char *file)
+{
+	char dir[80];
+	const char *name;
+	int notify_fd;
+	int watch_fd;
+
+	/* split the path into directory and file name */
+	name = strrchr(file, '/');
+	if (name) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(name - file), file);
+		if (!dir[0])
+			strcpy(dir, "/");
+		name++;
+	} else {
+		strcpy(dir, ".");
+		name = file;
+	}
+	snprintf(loop.watch_name, sizeof(loop.watch_name), "%s", name);
+
+	/* initialize inotify instance */
+	notify_fd = inotify_init1(IN_NONBLOCK);
+	if (notify_fd == -1) {
+		fprintf(stderr, "Error initializing inotify instance\n");
+		return -1;
+	}
+
+	/* create a watch descriptor for the directory, sensitive to files
+	 * that are completely written or moved into place */
+	watch_fd = inotify_add_watch(notify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (watch_fd == -1) {
+		fprintf(stderr, "Error adding config file to watch list\n");
+		close(notify_fd);
+		return -1;
+	}
+	return notify_fd;
+}
+
+/* callback function for the ini file parsing library, collects the
+ * [profile:<name>] sections, the other sections are skipped
+ * @buffer:	main loop (struct pcimax_loop), gets the profiles
+ * @ret_val:	0 if the setting is unknown or the value is invalid */
+static int pcimax_profile_ini_cb(void *buffer, const char *section,
+				 const char *name, const char *value)
+{
+	struct pcimax_loop *state = buffer;
+	struct pcimax_profile *profile = NULL;
+	const struct pcimax_key *key;
+	size_t i;
+
+	if (strncmp(section, "profile:", 8))
+		return 1;
+	section += 8;
+	for (i = 0; i < state->profile_count; i++) {
+		if (strcmp(state->profiles[i].name, section) == 0)
+			profile = &state->profiles[i];
+	}
+	if (!profile) {
+		if (state->profile_count >= PCIMAX_PROFILE_MAX) {
+			fprintf(stderr, "Too many profiles, %s ignored\n", section);
+			return 1;
+		}
+		profile = &state->profiles[state->profile_count++];
+		memset(profile, 0, sizeof(*profile));
+		snprintf(profile->name, sizeof(profile->name), "%s", section);
+	}
+	key = pcimax_find_key(name);
+	if (!key)
+		return 0;
+	return key->parse(&profile->values, key, value);
+}
+
+/* reads the profiles of the config file */
+static void pcimax_profiles_load(const char *file)
+{
+	loop.profile_count = 0;
+	ini_parse(file, pcimax_profile_ini_cb, &loop);
+}
+
+/* prepares the commands of the settings in @mask of a compiled target,
+ * quietly */
+static void pcimax_compile_plan(struct pcimax_card_profile *compiled,
+				uint32_t mask)
+{
+	pcimax_plan_init(&compiled->plan, NULL);
+	pcimax_plan_fm(&compiled->plan, &compiled->settings, mask);
+	pcimax_plan_rds(&compiled->plan, &compiled->settings, mask);
+	pcimax_plan_optimize(&compiled->plan, &compiled->settings, NULL);
+}
+
+/* compiles the profiles for a card, the commands only cover the settings
+ * of the profile itself, so they don't depend on @base
+ * @base:	settings of the card without a profile */
+static void pcimax_profiles_compile(struct pcimax_card *card,
+				    const struct pcimax_values *base)
+{
+	struct pcimax_card_profile *compiled;
+	const struct pcimax_values *values;
+
+	for (size_t i = 0; i < loop.profile_count; i++) {
+		compiled = &card->profiles[i];
+		values = &loop.profiles[i].values;
+		compiled->settings = *base;
+		pcimax_values_copy(&compiled->settings, values, values->defined);
+		compiled->settings.defined |= values->defined;
+		/* the commands of the profile settings, as they'd be sent to
+		 * a card whose state is unknown */
+		pcimax_compile_plan(compiled, values->defined);
+	}
+}
+
+/* @ret_val:	index of the profile, -1 if there is none with this name */
+static int pcimax_profile_find(const char *name)
+{
+	for (size_t i = 0; i < loop.profile_count; i++) {
+		if (strcmp(loop.profiles[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* keeps the TA flag of the last trigger (SIGUSR1 / SIGUSR2) in settings
+ * that are read again from the config file, so that a reload or a card
+ * that is plugged in doesn't end a traffic announcement early, or start one
+ * again. The other updates build on the current settings of the cards,
+ * which already have the flag */
+static void pcimax_ta_keep(struct pcimax_values *settings)
+{
+	if (loop.ta_override && (settings->defined & PCIMAX_TA))
+		settings->ta = loop.ta_override;
+}
+
+/* ends the announcement of the last trigger on an explicit TA change, a
+ * schedule entry, a profile, a request or an edit of the config file
+ * @fields:	settings that are about to be changed */
+static void pcimax_ta_release(uint32_t fields)
+{
+	if (fields & PCIMAX_TA)
+		loop.ta_override = 0;
+}
+
+/* queues the compiled commands of the settings of @target that differ
+ * from the current settings of the card, AF / DI slots only if they differ
+ * @keys:	settings of @target that may be sent, the others stay as
+ *		they are on the card
+ * @ret_val:	number of queued commands */
+static size_t pcimax_compiled_send(struct pcimax_card *card,
+				   const struct pcimax_card_profile *target,
+				   uint32_t keys)
+{
+	const struct pcimax_frame *frame;
+	struct pcimax_plan plan;
+	uint32_t mask;
+
+	mask = pcimax_values_diff(&card->settings, &target->settings) & keys;
+	/* the FM commit is needed with every FM setting */
+	if (mask & PCIMAX_FM_FIELDS)
+		mask |= PCIMAX_FM;
+	pcimax_plan_init(&plan, NULL);
+	for (size_t i = 0; i < target->plan.count; i++) {
+		frame = &target->plan.frames[i];
+		if (frame->field & mask)
+			plan.frames[plan.count++] = *frame;
+	}
+	pcimax_plan_optimize(&plan, &target->settings, &card->settings);
+
+	/* update the settings before sending, requests that are served while
+	 * the commands are sent build on top of them */
+	pcimax_values_copy(&card->settings, &target->settings, mask);
+	card->settings.defined |= target->settings.defined;
+	pcimax_sched_add(card, &plan, &card->settings, mask, false);
+	pcimax_sched_kick(card);
+	return plan.count;
+}
+
+/* switches a card to a compiled profile, only the commands of the settings
+ * that differ from the current settings of the card are sent. The profile
+ * goes on top of the current settings, changes made since the config file
+ * was read (feed, daemon requests, batch, schedule) are kept for the
+ * settings the profile doesn't define */
+static void pcimax_profile_switch(struct pcimax_card *card, int idx)
+{
+	struct pcimax_card_profile *compiled = &card->profiles[idx];
+	const struct pcimax_values *values = &loop.profiles[idx].values;
+	size_t count;
+
+	if (card->failed)
+		return;
+	/* the compiled TA command of the profile is sent */
+	pcimax_ta_release(values->defined);
+	compiled->settings = card->settings;
+	pcimax_values_copy(&compiled->settings, values, values->defined);
+	compiled->settings.defined |= values->defined;
+	count = pcimax_compiled_send(card, compiled, values->defined);
+	pcimax_card_prefix(card);
+	printf("Switching to profile %s, %zu commands\n",
+	       loop.profiles[idx].name, count);
+	snprintf(card->profile, sizeof(card->profile), "%s", loop.profiles[idx].name);
+}
+
+/* callback function for the ini file parsing library, collects the
+ * entries of the [schedule] section, the other sections are skipped, e.g.
+ *   [schedule]
+ *   07:30 = ta=true
+ *   07:35:30 = ta=false
+ *   every 15m = rt=Listen to the news at full hour
+ * a time of day (HH:MM[:SS], local time) or an interval (s, m, h, counted
+ * from midnight), and one setting with the name of the config file.
+ * Entries that are due at the same time are sent together
+ * @buffer:	main loop (struct pcimax_loop), gets the entries
+ * @ret_val:	0 if the entry is invalid */
+static int pcimax_timetable_ini_cb(void *buffer, const char *section,
+				   const char *name, const char *value)
+{
+	struct pcimax_loop *state = buffer;
+	struct pcimax_timetable_entry *entry;
+	const struct pcimax_key *key;
+	unsigned int hour, min, sec = 0;
+	unsigned int every;
+	char unit = 's';
+	char setting[32];
+	int len = 0;
+
+	if (strcmp(section, "schedule"))
+		return 1;
+	if (state->timetable_count >= PCIMAX_TIMETABLE_MAX) {
+		fprintf(stderr, "Too many schedule entries, %s ignored\n", name);
+		return 1;
+	}
+	entry = &state->timetable[state->timetable_count];
+	memset(entry, 0, sizeof(*entry));
+
+	if (sscanf(name, "every %u%c", &every, &unit) >= 1) {
+		if (unit == 'm')
+			every *= 60;
+		else if (unit == 'h')
+			every *= 3600;
+		else if (unit != 's')
+			every = 0;
+		if (!every || every > 24 * 3600)
+			goto invalid;
+		entry->every = every;
+	} else if (sscanf(name, "%u:%u:%u", &hour, &min, &sec) >= 2 &&
+		   hour < 24 && min < 60 && sec < 60) {
+		entry->at = hour * 3600 + min * 60 + sec;
+	} else {
+		goto invalid;
+	}
+
+	/* <name>=<value> */
+	if (sscanf(value, " %31[^= \t] = %n", setting, &len) < 1 || !len)
+		goto invalid;
+	key = pcimax_find_key(setting);
+	if (!key || !key->parse(&entry->values, key, value + len))
+		goto invalid;
+	state->timetable_count++;
+	return 1;
+
+invalid:
+	fprintf(stderr, "Invalid schedule entry: %s = %s\n", name, value);
+	return 0;
+}
+
+/* @ret_val:	the first time after @now the entry is due */
+static time_t pcimax_timetable_next(const struct pcimax_timetable_entry *entry,
+				    time_t now)
+{
+	struct tm day;
+	struct tm tm;
+	time_t midnight;
+	time_t next;
+
+	localtime_r(&now, &day);
+	day.tm_hour = day.tm_min = day.tm_sec = 0;
+	day.tm_isdst = -1;
+	tm = day;
+	midnight = mktime(&tm);
+
+	if (entry->every) {
+		next = midnight + ((now - midnight) / entry->every + 1) * entry->every;
+		/* the intervals start over at midnight */
+		tm = day;
+		tm.tm_mday++;
+		return next < mktime(&tm) ? next : mktime(&tm);
+	}
+	/* mktime normalizes the seconds into the time of day, across DST
+	 * changes as well */
+	tm = day;
+	tm.tm_sec = entry->at;
+	next = mktime(&tm);
+	if (next > now)
+		return next;
+	tm = day;
+	tm.tm_mday++;
+	tm.tm_sec = entry->at;
+	return mktime(&tm);
+}
+
+/* compiles the changes that are due next for a card, on top of its current
+ * settings, so that only the diff remains to be done when they're due */
+static void pcimax_timetable_compile(struct pcimax_card *card)
+{
+	const struct pcimax_values *values = &loop.timetable_values;
+	struct pcimax_card_profile *compiled = &card->timetable;
+
+	card->timetable_base = card->settings;
+	compiled->settings = card->settings;
+	pcimax_values_copy(&compiled->settings, values, values->defined);
+	compiled->settings.defined |= values->defined;
+	pcimax_compile_plan(compiled, pcimax_values_diff(&card->settings,
+							 &compiled->settings));
+}
+
+/* finds the entries that are due next, compiles their changes for all
+ * cards and sets the timer to their time
+ * @now:	entries due after this time are considered */
+static void pcimax_timetable_arm(time_t now)
+{
+	struct pcimax_timetable_entry *entry;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct pcimax_values *values = &loop.timetable_values;
+
+	loop.timetable_due = 0;
+	for (size_t i = 0; i < loop.timetable_count; i++) {
+		entry = &loop.timetable[i];
+		if (entry->next <= now)
+			entry->next = pcimax_timetable_next(entry, now);
+		if (!loop.timetable_due || entry->next < loop.timetable_due)
+			loop.timetable_due = entry->next;
+	}
+
+	/* later entries of the file override earlier ones */
+	memset(values, 0, sizeof(*values));
+	for (size_t i = 0; i < loop.timetable_count; i++) {
+		entry = &loop.timetable[i];
+		if (entry->next != loop.timetable_due)
+			continue;
+		pcimax_values_copy(values, &entry->values, entry->values.defined);
+		values->defined |= entry->values.defined;
+	}
+	for (size_t i = 0; i < card_count; i++) {
+		if (!cards[i].failed)
+			pcimax_timetable_compile(&cards[i]);
+	}
+
+	/* an absolute time of the wall clock, the timer is cancelled if the
+	 * clock is set, an expired timer is disarmed */
+	its.it_value.tv_sec = loop.timetable_due;
+	if (loop.timetable_fd >= 0 &&
+	    timerfd_settime(loop.timetable_fd,
+			    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			    &its, NULL) < 0)
+		perror("Unable to set the schedule timer: ");
+}
+
+/* reads the [schedule] section of the config file and sets the timer to
+ * the first entries */
+static void pcimax_timetable_load(const char *file)
+{
+	loop.timetable_count = 0;
+	ini_parse(file, pcimax_timetable_ini_cb, &loop);
+	pcimax_timetable_arm(time(NULL));
+}
+
+/* sends the changes of the schedule that are due now with the commands
+ * that were compiled in advance, a card whose settings changed since then
+ * gets them compiled again */
+static void pcimax_timetable_fire(void)
+{
+	struct pcimax_card *card;
+	uint64_t expirations;
+	time_t due = loop.timetable_due;
+	size_t count;
+
+	/* the wall clock was set, the entries are due at other times */
+	if (read(loop.timetable_fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == ECANCELED) {
+			for (size_t i = 0; i < loop.timetable_count; i++)
+				loop.timetable[i].next = 0;
+			pcimax_timetable_arm(time(NULL));
+		}
+		return;
+	}
+	if (!due)
+		return;
+
+	pcimax_ta_release(loop.timetable_values.defined);
+	for (size_t i = 0; i < card_count; i++) {
+		card = &cards[i];
+		if (card->failed)
+			continue;
+		if (card->settings.defined != card->timetable_base.defined ||
+		    !pcimax_values_equal(&card->settings, &card->timetable_base, ~0u))
+			pcimax_timetable_compile(card);
+		count = pcimax_compiled_send(card, &card->timetable,
+					     loop.timetable_values.defined);
+		/* values the card already has are no news */
+		if (!count && !verbose)
+			continue;
+		pcimax_card_prefix(card);
+		printf("Scheduled change, %zu commands\n", count);
+	}
+	pcimax_timetable_arm(due);
+}
+
+/* re-reads the config file and sends only the settings that changed since
+ * the last update to the cards */
+static void pcimax_reload(void)
+{
+	const char *file = loop.settings->file;
+	struct pcimax_values base;
+	struct pcimax_values next;
+	struct pcimax_card *card;
+	uint32_t changed;
+	int profile;
+
+	/* parse into a fresh struct, nothing of the previous contents may
+	 * leak into the new values */
+	memset(&base, 0, sizeof(base));
+	if (ini_parse(file, pcimax_ini_cb, &base) < 0) {
+		fprintf(stderr, "Unable to open ini file: %s\n", file);
+		return;
+	}
+	loop.reloads++;
+	pcimax_ta_release(pcimax_values_diff(&loop.base, &base));
+	loop.base = base;
+	pcimax_profiles_load(file);
+	if (pcimax_profile_find(loop.profile) < 0)
+		loop.profile[0] = '\0';
+	for (size_t i = 0; i < card_count; i++) {
+		card = &cards[i];
+		if (card->failed)
+			continue;
+		next = base;
+		pcimax_card_settings(card, file, &next);
+		/* a card stays in its profile, if the profile still exists */
+		pcimax_profiles_compile(card, &next);
+		profile = pcimax_profile_find(card->profile);
+		if (profile >= 0)
+			next = card->profiles[profile].settings;
+		else
+			card->profile[0] = '\0';
+		pcimax_ta_keep(&next);
+		/* update only the values that differ from the card state */
+		changed = pcimax_values_diff(&card->settings, &next);
+		if (!changed) {
+			pcimax_card_prefix(card);
+			printf("No changes detected\n");
+			continue;
+		}
+		/* update the settings before sending, requests that are
+		 * served while the commands are sent build on top of them */
+		pcimax_values_copy(&card->settings, &next, changed);
+		card->settings.defined |= next.defined;
+		pcimax_card_apply(card, changed);
+	}
+	/* the schedule is compiled on top of the new settings */
+	if (loop.timetable_fd >= 0)
+		pcimax_timetable_load(file);
+}
+
+/* handles events of the watched directory, modifications of the config
+ * file (re)start the debounce timer, so that a burst of writes results in
+ * a single reload of the final contents
+ * @ret_val:	false if the config file can't be monitored anymore */
+static bool pcimax_monitor_handle(int notify_fd)
+{
+	#define BUF_LEN (sizeof(struct inotify_event) + NAME_MAX + 1) * 16
+	const struct inotify_event *event;
+	struct itimerspec its = { .it_interval = { 0, 0 } };
+	bool modified = false;
+	char buffer[BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t rd_cnt;
+
+	/* consume all pending events */
+	while ((rd_cnt = read(notify_fd, buffer, BUF_LEN)) > 0) {
+		for (char *pos = buffer; pos < buffer + rd_cnt;
+		     pos += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)pos;
+			if (event->mask & IN_IGNORED) {
+				fprintf(stderr, "Config file directory was removed\n");
+				return false;
+			}
+			if (event->len && strcmp(event->name, loop.watch_name) == 0)
+				modified = true;
+		}
+	}
+	if (rd_cnt == 0 || (rd_cnt < 0 && errno != EAGAIN)) {
+		fprintf(stderr, "Error reading from monitored config file\n");
+		return false;
+	}
+	if (!modified)
+		return true;
+
+	/* file was modified, apply it once it is left alone */
+	its.it_value.tv_sec = loop.debounce / 1000;
+	its.it_value.tv_nsec = (loop.debounce % 1000) * 1000000 + 1;
+	timerfd_settime(loop.debounce_fd, 0, &its, NULL);
+	return true;
+}
+
+/* the config file wasn't modified for the debounce time, apply it */
+static void pcimax_monitor_reload(void)
+{
+	uint64_t expirations;
+
+	if (read(loop.debounce_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	pcimax_reload();
+	printf("\n Monitoring config file for changes\n");
+	printf("End program with ctrl+c\n"); 
+}
+
+/* creates the control socket of the daemon
+ * @ret_val:	listening socket, -1 on error */
+static int pcimax_daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket: ");
+		return -1;
+	}
+	/* refuse to take over the socket of a running daemon, but remove
+	 * stale sockets of daemons that are gone */
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Daemon already running on %s\n", path);
+		close(sock);
+		return -1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 4) < 0) {
+		fprintf(stderr, "Unable to listen on %s", path);
+		perror(": ");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* applies the staged values on top of the current settings
+ * the values are staged as text, so that only the settings the client set
+ * are modified, even if other requests changed the settings meanwhile */
+static void pcimax_staged_merge(const struct pcimax_staged *staged,
+				struct pcimax_values *settings)
+{
+	for (size_t i = 0; i < staged->count; i++)
+		staged->entries[i].key->parse(settings, staged->entries[i].key,
+					      staged->entries[i].value);
+}
+
+/* sends the staged values that differ from the current settings
+ * @card:	index of the card the values are meant for, -1: all cards */
+static void pcimax_staged_apply(struct pcimax_staged *staged, int card)
+{
+	struct pcimax_values next;
+	uint32_t changed;
+
+	for (size_t i = 0; i < staged->count; i++)
+		pcimax_ta_release(staged->entries[i].key->bit);
+	for (size_t i = 0; i < card_count; i++) {
+		if ((card >= 0 && (size_t)card != i) || cards[i].failed)
+			continue;
+		next = cards[i].settings;
+		pcimax_staged_merge(staged, &next);
+		changed = pcimax_values_diff(&cards[i].settings, &next);
+		/* update the settings before sending, requests that are
+		 * served while the commands are sent build on top of them */
+		cards[i].settings = next;
+		pcimax_card_apply(&cards[i], changed);
+	}
+	staged->count = 0;
+}
+
+/* handles a request of a client of the control socket
+ * protocol: one request per line, every request is answered by
+ * "ok" or "error <reason>", a "get" is preceded by <name>=<value> lines
+ *   card [<id>|all]	address the requests to one card (USB serial,
+ *			sysfs path or device), or to all cards (default)
+ *   set <name>=<value>	stage a new value for a setting
+ *   get [<name>]	query a setting, or all defined settings, if
+ *			several cards are addressed, the values of each card
+ *			are preceded by a "card <id>" line
+ *   apply		send the staged settings that changed to the cards
+ *   profile <name>	switch to a profile of the config file, staged
+ *			settings are applied before
+ *   metrics		the metrics of all cards (see --metrics)
+ * staged settings are applied as well when the client disconnects or
+ * addresses another card
+ * @line:	request without line break */
+static void pcimax_daemon_request(struct pcimax_client *client, char *line)
+{
+	const struct pcimax_key *key;
+	struct pcimax_staged *staged = &client->staged;
+	struct pcimax_values tmp;
+	struct pcimax_card *card;
+	char value[PCIMAX_LINE_MAX];
+	char *arg;
+
+	arg = strchr(line, ' ');
+	if (arg)
+		*arg++ = '\0';
+
+	if (strcmp(line, "card") == 0) {
+		card = NULL;
+		if (arg && strcmp(arg, "all") && !(card = pcimax_card_find(arg))) {
+			dprintf(client->fd, "error unknown card %s\n", arg);
+			return;
+		}
+		if (staged->count)
+			pcimax_staged_apply(staged, client->card);
+		client->card = card ? card - cards : -1;
+		dprintf(client->fd, "ok\n");
+	} else if (strcmp(line, "set") == 0) {
+		char *val = arg ? strchr(arg, '=') : NULL;
+
+		if (!val) {
+			dprintf(client->fd, "error expected <name>=<value>\n");
+			return;
+		}
+		*val++ = '\0';
+		key = pcimax_find_key(arg);
+		/* validate the value before staging it */
+		tmp = cards[client->card < 0 ? 0 : client->card].settings;
+		if (!key || !key->parse(&tmp, key, val)) {
+			dprintf(client->fd, "error invalid setting %s\n", arg);
+			return;
+		}
+		if (staged->count >= PCIMAX_STAGED_MAX)
+			pcimax_staged_apply(staged, client->card);
+		staged->entries[staged->count].key = key;
+		snprintf(staged->entries[staged->count].value,
+			 PCIMAX_LINE_MAX, "%s", val);
+		staged->count++;
+		dprintf(client->fd, "ok\n");
+	} else if (strcmp(line, "get") == 0) {
+		if (arg && !pcimax_find_key(arg)) {
+			dprintf(client->fd, "error unknown setting %s\n", arg);
+			return;
+		}
+		for (size_t i = 0; i < card_count; i++) {
+			if (client->card >= 0 && (size_t)client->card != i)
+				continue;
+			if (client->card < 0 && card_count > 1)
+				dprintf(client->fd, "card %s\n", cards[i].key);
+			tmp = cards[i].settings;
+			pcimax_staged_merge(staged, &tmp);
+			for (key = pcimax_keys; key->name; key++) {
+				if ((arg && strcmp(arg, key->name)) ||
+				    !(tmp.defined & key->bit))
+					continue;
+				key->format(&tmp, key, value);
+				dprintf(client->fd, "%s=%s\n", key->name, value);
+			}
+		}
+		dprintf(client->fd, "ok\n");
+	} else if (strcmp(line, "apply") == 0) {
+		pcimax_staged_apply(staged, client->card);
+		dprintf(client->fd, "ok\n");
+	} else if (strcmp(line, "profile") == 0) {
+		int profile = arg ? pcimax_profile_find(arg) : -1;
+
+		if (profile < 0) {
+			dprintf(client->fd, "error unknown profile %s\n",
+				arg ? arg : "");
+			return;
+		}
+		if (staged->count)
+			pcimax_staged_apply(staged, client->card);
+		for (size_t i = 0; i < card_count; i++) {
+			if ((client->card >= 0 && (size_t)client->card != i) ||
+			    cards[i].failed)
+				continue;
+			pcimax_profile_switch(&cards[i], profile);
+		}
+		if (client->card < 0)
+			strcpy(loop.profile, loop.profiles[profile].name);
+		dprintf(client->fd, "ok\n");
+	} else if (strcmp(line, "metrics") == 0) {
+		pcimax_metrics_write(client->fd);
+		dprintf(client->fd, "ok\n");
+	} else {
+		dprintf(client->fd, "error unknown request %s\n", line);
+	}
+}
+
+/* closes a connection to the control socket, the values the client left
+ * behind are applied */
+static void pcimax_daemon_close(struct pcimax_client *client)
+{
+	if (client->staged.count)
+		pcimax_staged_apply(&client->staged, client->card);
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->fd = -1;
+}
+
+/* reads the available data of a client and handles all complete requests */
+static void pcimax_daemon_read(struct pcimax_client *client)
+{
+	char *start;
+	char *end;
+	ssize_t rd_cnt;
+
+	rd_cnt = read(client->fd, client->buf + client->len,
+		      sizeof(client->buf) - client->len - 1);
+	if (rd_cnt < 0 && errno == EAGAIN)
+		return;
+	if (rd_cnt <= 0) {
+		pcimax_daemon_close(client);
+		return;
+	}
+	client->len += rd_cnt;
+	client->buf[client->len] = '\0';
+
+	start = client->buf;
+	while ((end = strchr(start, '\n'))) {
+		*end = '\0';
+		if (end > start && end[-1] == '\r')
+			end[-1] = '\0';
+		pcimax_daemon_request(client, start);
+		start = end + 1;
+	}
+	client->len -= start - client->buf;
+	memmove(client->buf, start, client->len);
+	/* a request that doesn't fit into the buffer can't be valid */
+	if (client->len >= sizeof(client->buf) - 1) {
+		dprintf(client->fd, "error request too long\n");
+		client->len = 0;
+	}
+}
+
+/* accepts a new connection to the control socket */
+static void pcimax_daemon_accept(int sock)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int client;
+	int i;
+
+	client = accept(sock, NULL, NULL);
+	if (client < 0)
+		return;
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	for (i = 0; i < PCIMAX_CLIENT_MAX && loop.clients[i].fd >= 0; i++)
+		;
+	if (i == PCIMAX_CLIENT_MAX) {
+		dprintf(client, "error too many clients\n");
+		close(client);
+		return;
+	}
+	loop.clients[i].fd = client;
+	loop.clients[i].len = 0;
+	loop.clients[i].card = -1;
+	loop.clients[i].staged.count = 0;
+	ev.data.u64 = PCIMAX_SRC_CLIENT | ((uint64_t)i << 32);
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client, &ev);
+}
+
+/* takes a line of the feed: "rt=<text>", "pty=<code>", "ms=<music|speech>",
+ * any other line is a new RT. The value replaces the one that is waiting
+ * for the cards, if any */
+static void pcimax_feed_line(const char *line)
+{
+	static const char *names[] = { "rt", "pty", "ms" };
+	const struct pcimax_key *key = pcimax_find_key("rt");
+	const char *value = line;
+	size_t len;
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		len = strlen(names[i]);
+		if (strncmp(line, names[i], len) == 0 && line[len] == '=') {
+			key = pcimax_find_key(names[i]);
+			value = line + len + 1;
+			break;
+		}
+	}
+	if (!value[0])
+		return;
+	if (!key->parse(&loop.feed.values, key, value)) {
+		fprintf(stderr, "Invalid feed value: %s\n", line);
+		return;
+	}
+	for (size_t i = 0; i < card_count; i++)
+		cards[i].feed_staged |= key->bit;
+}
+
+/* sends the newest feed values to the cards that are done with the
+ * previous ones, so that a burst of updates doesn't build up a backlog:
+ * the values that arrive while the card is busy are coalesced, values
+ * the card already has are not sent again */
+static void pcimax_feed_flush(void)
+{
+	struct pcimax_values next;
+	struct pcimax_card *card;
+	uint32_t changed;
+	bool pending;
+
+	for (size_t i = 0; i < card_count; i++) {
+		card = &cards[i];
+		if (!card->feed_staged || card->failed)
+			continue;
+		pending = false;
+		for (int bit = 0; bit < 32; bit++) {
+			if ((card->feed_staged & (1u << bit)) && card->sched.pending[bit])
+				pending = true;
+		}
+		if (pending)
+			continue;
+		pcimax_ta_release(card->feed_staged);
+		next = card->settings;
+		pcimax_values_copy(&next, &loop.feed.values, card->feed_staged);
+		next.defined |= card->feed_staged;
+		changed = pcimax_values_diff(&card->settings, &next) &
+			  card->feed_staged;
+		card->feed_staged = 0;
+		if (!changed)
+			continue;
+		card->settings = next;
+		pcimax_card_apply(card, changed);
+	}
+}
+
+/* reads the available data of the feed and takes all complete lines, at
+ * the end of stdin the program ends, once everything is sent (unless it
+ * runs as daemon / monitor) */
+static void pcimax_feed_read(void)
+{
+	struct pcimax_feed *feed = &loop.feed;
+	char *start;
+	char *end;
+	ssize_t rd_cnt;
+
+	rd_cnt = read(feed->fd, feed->buf + feed->len,
+		      sizeof(feed->buf) - feed->len - 1);
+	if (rd_cnt < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (rd_cnt <= 0) {
+		if (feed->len) {
+			feed->buf[feed->len] = '\0';
+			pcimax_feed_line(feed->buf);
+		}
+		if (!feed->file)
+			epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, feed->fd, NULL);
+		if (feed->fd != STDIN_FILENO)
+			close(feed->fd);
+		feed->fd = -1;
+		feed->file = false;
+		if (!loop.settings->options[OptDaemon] &&
+		    !loop.settings->options[OptMonitor] && loop.batch.fd < 0)
+			loop.persistent = false;
+		return;
+	}
+	feed->len += rd_cnt;
+	feed->buf[feed->len] = '\0';
+
+	start = feed->buf;
+	while ((end = strchr(start, '\n'))) {
+		*end = '\0';
+		if (end > start && end[-1] == '\r')
+			end[-1] = '\0';
+		pcimax_feed_line(start);
+		start = end + 1;
+	}
+	feed->len -= start - feed->buf;
+	memmove(feed->buf, start, feed->len);
+	/* longer than any valid value */
+	if (feed->len >= sizeof(feed->buf) - 1) {
+		fprintf(stderr, "Feed line too long, dropped\n");
+		feed->len = 0;
+	}
+}
+
+/* removes the leading and trailing white space of @str
+ * @ret_val:	first character that isn't white space */
+static char *pcimax_strip(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return str;
+}
+
+/* ends the open transaction of the batch, the staged values that changed
+ * are sent to the addressed cards together */
+static void pcimax_batch_commit(void)
+{
+	if (loop.batch.staged.count)
+		pcimax_staged_apply(&loop.batch.staged, loop.batch.card);
+}
+
+/* starts a section of an ini fragment: [FM] and [RDS] address all cards,
+ * [card:<id>] a single one. A transaction never spans several cards */
+static void pcimax_batch_section(const char *name)
+{
+	struct pcimax_batch *batch = &loop.batch;
+	struct pcimax_card *card = NULL;
+
+	batch->skip = false;
+	if (strncmp(name, "card:", 5) == 0) {
+		card = pcimax_card_find(name + 5);
+		if (!card) {
+			fprintf(stderr, "Batch line %u: unknown card %s\n",
+				batch->line, name + 5);
+			batch->skip = true;
+			return;
+		}
+	} else if (strcmp(name, "FM") && strcmp(name, "RDS")) {
+		fprintf(stderr, "Batch line %u: unknown section [%s]\n",
+			batch->line, name);
+		batch->skip = true;
+		return;
+	}
+	if (batch->card != (card ? card - cards : -1))
+		pcimax_batch_commit();
+	batch->card = card ? card - cards : -1;
+	snprintf(batch->section, sizeof(batch->section), "%s",
+		 card ? "" : name);
+}
+
+/* takes a line of the batch: "<name>=<value>" with the names of the
+ * config file, "--set-<name>=<value>" as on the command line, or an ini
+ * fragment with sections and comments, e.g.
+ *   [RDS]
+ *   ps = NEWS
+ *   rt = Headlines	; comment
+ *
+ *   [card:0001]
+ *   freq = 98.5
+ *   commit
+ * the values are staged until a blank line or a "commit" line ends the
+ * transaction
+ * @line:	line without line break */
+static void pcimax_batch_line(char *line)
+{
+	struct pcimax_batch *batch = &loop.batch;
+	const struct pcimax_key *key;
+	struct pcimax_values tmp;
+	char *value;
+	char *end;
+
+	batch->line++;
+	line = pcimax_strip(line);
+	if (!line[0] || strcmp(line, "commit") == 0) {
+		pcimax_batch_commit();
+		return;
+	}
+	if (line[0] == ';' || line[0] == '#')
+		return;
+	if (line[0] == '[') {
+		end = strchr(line, ']');
+		if (!end) {
+			fprintf(stderr, "Batch line %u: expected [<section>]\n",
+				batch->line);
+			batch->skip = true;
+			return;
+		}
+		*end = '\0';
+		pcimax_batch_section(line + 1);
+		return;
+	}
+	if (batch->skip)
+		return;
+
+	if (strncmp(line, "--set-", 6) == 0)
+		line += 6;
+	value = strchr(line, '=');
+	if (!value) {
+		fprintf(stderr, "Batch line %u: expected <name>=<value>\n",
+			batch->line);
+		return;
+	}
+	*value++ = '\0';
+	/* a ';' after white space starts a comment, as in the config file */
+	for (end = value; *end; end++) {
+		if (*end == ';' && end > value && isspace((unsigned char)end[-1])) {
+			*end = '\0';
+			break;
+		}
+	}
+	line = pcimax_strip(line);
+	value = pcimax_strip(value);
+
+	/* validate the value before staging it, the values of the [FM] /
+	 * [RDS] sections only count in their own section */
+	key = pcimax_find_key(line);
+	tmp = cards[batch->card < 0 ? 0 : batch->card].settings;
+	if (!key || !pcimax_ini_cb(&tmp, batch->section[0] ?
+				   batch->section : key->section, line, value)) {
+		fprintf(stderr, "Batch line %u: invalid setting %s\n",
+			batch->line, line);
+		return;
+	}
+	if (batch->staged.count >= PCIMAX_STAGED_MAX)
+		pcimax_batch_commit();
+	batch->staged.entries[batch->staged.count].key = key;
+	snprintf(batch->staged.entries[batch->staged.count].value,
+		 PCIMAX_LINE_MAX, "%s", value);
+	batch->staged.count++;
+}
+
+/* reads the available data of the batch and takes all complete lines, at
+ * the end of the input the open transaction is committed and the program
+ * ends once everything is sent (unless it runs as daemon / monitor) */
+static void pcimax_batch_read(void)
+{
+	struct pcimax_batch *batch = &loop.batch;
+	char *start;
+	char *end;
+	ssize_t rd_cnt;
+
+	rd_cnt = read(batch->fd, batch->buf + batch->len,
+		      sizeof(batch->buf) - batch->len - 1);
+	if (rd_cnt < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (rd_cnt <= 0) {
+		if (batch->len && !batch->dropped) {
+			batch->buf[batch->len] = '\0';
+			pcimax_batch_line(batch->buf);
+		}
+		batch->dropped = false;
+		pcimax_batch_commit();
+		if (!batch->file)
+			epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, batch->fd, NULL);
+		if (batch->fd != STDIN_FILENO)
+			close(batch->fd);
+		batch->fd = -1;
+		batch->file = false;
+		if (!loop.settings->options[OptDaemon] &&
+		    !loop.settings->options[OptMonitor] && loop.feed.fd < 0)
+			loop.persistent = false;
+		return;
+	}
+	batch->len += rd_cnt;
+	batch->buf[batch->len] = '\0';
+
+	start = batch->buf;
+	while ((end = strchr(start, '\n'))) {
+		*end = '\0';
+		/* the rest of a line that was dropped */
+		if (batch->dropped)
+			batch->line++;
+		else
+			pcimax_batch_line(start);
+		batch->dropped = false;
+		start = end + 1;
+	}
+	batch->len -= start - batch->buf;
+	memmove(batch->buf, start, batch->len);
+	/* longer than any valid value, a section that is dropped takes its
+	 * values with it, they'd go to the previous section otherwise */
+	if (batch->len >= sizeof(batch->buf) - 1) {
+		if (!batch->dropped) {
+			fprintf(stderr, "Batch line %u too long, dropped\n",
+				batch->line + 1);
+			if (pcimax_strip(batch->buf)[0] == '[')
+				batch->skip = true;
+		}
+		batch->dropped = true;
+		batch->len = 0;
+	}
+}
+
+/* adds a file descriptor to the main loop
+ * @data:	source of the events, see enum pcimax_source
+ * @ret_val:	false on error */
+static bool pcimax_loop_add(int add_fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = data };
+
+	if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, add_fd, &ev) < 0) {
+		perror("epoll_ctl: ");
+		return false;
+	}
+	return true;
+}
+
+/* prepares the TA frames of the SIGUSR1 / SIGUSR2 triggers, so that a
+ * trigger needs no parsing and no encoding */
+static void pcimax_ta_prepare(void)
+{
+	const struct pcimax_key *key = pcimax_find_key("ta");
+	struct pcimax_values values;
+	struct pcimax_plan plan;
+
+	for (int on = 0; on < 2; on++) {
+		memset(&values, 0, sizeof(values));
+		key->parse(&values, key, on ? "true" : "false");
+		pcimax_plan_init(&plan, NULL);
+		key->encode(&plan, &values, key);
+		loop.ta_frames[on] = plan.frames[0];
+	}
+}
+
+/* switches the Traffic Announcement flag of all cards on a trigger, only
+ * the prepared TA frame is queued, with the highest priority, so that it
+ * preempts a running update at the next command boundary
+ * @start_us:	time the trigger was received, for the latency report */
+static void pcimax_ta_trigger(bool on, int64_t start_us)
+{
+	struct pcimax_card *card;
+	struct pcimax_plan plan;
+
+	pcimax_plan_init(&plan, NULL);
+	plan.frames[plan.count++] = loop.ta_frames[on];
+	loop.ta_override = on ? '1' : '0';
+	for (size_t i = 0; i < card_count; i++) {
+		card = &cards[i];
+		if (card->failed)
+			continue;
+		card->settings.ta = on ? '1' : '0';
+		card->settings.defined |= PCIMAX_TA;
+		card->ta_trigger_us = start_us;
+		pcimax_sched_add(card, &plan, &card->settings, PCIMAX_TA,
+				 false);
+		pcimax_sched_kick(card);
+	}
+}
+
+/* sets up the main loop, SIGINT / SIGTERM / SIGHUP, SIGUSR1 / SIGUSR2 (TA
+ * on / off) and SIGRTMIN+n (switch to profile n) are delivered as events
+ * from now on
+ * @settings:	settings from the command line and the config file */
+static void pcimax_loop_init(struct pcimax_settings *settings)
+{
+	sigset_t mask;
+
+	loop.settings = settings;
+	loop.base = settings->values;
+	for (int i = 0; i < PCIMAX_CLIENT_MAX; i++)
+		loop.clients[i].fd = -1;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	for (int i = 0; i < PCIMAX_PROFILE_MAX; i++)
+		sigaddset(&mask, SIGRTMIN + i);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	loop.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop.epoll_fd < 0 || loop.signal_fd < 0) {
+		perror("Unable to set up the main loop: ");
+		exit(1);
+	}
+	if (!pcimax_loop_add(loop.signal_fd, EPOLLIN, PCIMAX_SRC_SIGNAL))
+		exit(1);
+	pcimax_ta_prepare();
+}
+
+/* starts watching the config file for modifications
+ * @ret_val:	false if the config file can't be monitored */
+static bool pcimax_loop_monitor(const char *file)
+{
+	loop.notify_fd = pcimax_monitor_init(file);
+	if (loop.notify_fd < 0)
+		return false;
+	loop.debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop.debounce_fd < 0) {
+		perror("Unable to create the debounce timer: ");
+		return false;
+	}
+	if (!pcimax_loop_add(loop.notify_fd, EPOLLIN, PCIMAX_SRC_NOTIFY) ||
+	    !pcimax_loop_add(loop.debounce_fd, EPOLLIN, PCIMAX_SRC_DEBOUNCE))
+		return false;
+	loop.persistent = true;
+	return true;
+}
+
+/* starts serving requests on the control socket
+ * @ret_val:	false on error */
+static bool pcimax_loop_listen(int sock)
+{
+	loop.listen_fd = sock;
+	if (!pcimax_loop_add(sock, EPOLLIN, PCIMAX_SRC_LISTEN))
+		return false;
+	/* clients that disconnect early must not terminate the daemon */
+	signal(SIGPIPE, SIG_IGN);
+	loop.persistent = true;
+	return true;
+}
+
+/* starts reading the feed, a FIFO is opened for reading and writing, so
+ * that the writers can come and go without ending the stream
+ * @ret_val:	false on error */
+static bool pcimax_loop_feed(const char *path)
+{
+	struct pcimax_feed *feed = &loop.feed;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PCIMAX_SRC_FEED };
+	struct stat st;
+
+	/* stdin stays blocking, it's shared with the shell, the loop only
+	 * reads once per event. A regular file is only read */
+	if (strcmp(path, "-") == 0) {
+		feed->fd = STDIN_FILENO;
+	} else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+		feed->fd = open(path, O_RDONLY | O_CLOEXEC);
+	} else {
+		feed->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	}
+	if (feed->fd < 0) {
+		fprintf(stderr, "Unable to open feed %s", path);
+		perror(": ");
+		return false;
+	}
+	/* regular files (also on stdin) can't be watched by epoll, like a
+	 * batch file they're read whenever the cards are idle */
+	if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, feed->fd, &ev) < 0) {
+		if (errno != EPERM) {
+			perror("epoll_ctl: ");
+			return false;
+		}
+		feed->file = true;
+	}
+	loop.persistent = true;
+	return true;
+}
+
+/* starts reading the batch, regular files (also on stdin) can't be
+ * watched by epoll, they are read whenever the cards are idle
+ * @ret_val:	false on error */
+static bool pcimax_loop_batch(const char *path)
+{
+	struct pcimax_batch *batch = &loop.batch;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PCIMAX_SRC_BATCH };
+
+	if (strcmp(path, "-") == 0) {
+		batch->fd = STDIN_FILENO;
+	} else {
+		batch->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+	if (batch->fd < 0) {
+		fprintf(stderr, "Unable to open batch %s", path);
+		perror(": ");
+		return false;
+	}
+	if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, batch->fd, &ev) < 0) {
+		if (errno != EPERM) {
+			perror("epoll_ctl: ");
+			return false;
+		}
+		batch->file = true;
+	}
+	loop.persistent = true;
+	return true;
+}
+
+/* starts the [schedule] section of the config file, the timer follows the
+ * wall clock
+ * @ret_val:	false on error */
+static bool pcimax_loop_timetable(const char *file)
+{
+	loop.timetable_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop.timetable_fd < 0) {
+		perror("Unable to create the schedule timer: ");
+		return false;
+	}
+	if (!pcimax_loop_add(loop.timetable_fd, EPOLLIN, PCIMAX_SRC_TIMETABLE))
+		return false;
+	pcimax_timetable_load(file);
+	return true;
+}
+
+/* starts monitoring the tty subsystem, so that cards that were disconnected
+ * (e.g. after a reset of the USB link) are taken back into service as soon
+ * as they return, and new cards are picked up if the cards are auto-detected
+ * @ret_val:	false on error */
+static bool pcimax_hotplug_init(void)
+{
+	loop.udev = udev_new();
+	if (loop.udev)
+		loop.hotplug = udev_monitor_new_from_netlink(loop.udev, "udev");
+	if (!loop.hotplug ||
+	    udev_monitor_filter_add_match_subsystem_devtype(loop.hotplug, "tty", NULL) < 0 ||
+	    udev_monitor_enable_receiving(loop.hotplug) < 0) {
+		fprintf(stderr, "Unable to monitor the cards for hotplug events\n");
+		return false;
+	}
+	return pcimax_loop_add(udev_monitor_get_fd(loop.hotplug), EPOLLIN,
+			       PCIMAX_SRC_HOTPLUG);
+}
+
+/* brings a card that returned back into service, its state is unknown so
+ * all settings are replayed */
+static void pcimax_card_reconnect(struct pcimax_card *card)
+{
+	if (!pcimax_card_connect(card))
+		return;
+	printf("Card %s at %s reconnected, replaying settings\n", card->key,
+	       card->device);
+	pcimax_replay(card);
+}
+
+/* handles a card that was connected / disconnected */
+static void pcimax_hotplug_handle(void)
+{
+	struct udev_device *dev;
+	struct pcimax_card *card = NULL;
+	char serial[PCIMAX_KEY_MAX];
+	char real[PATH_MAX];
+	const char *action;
+	const char *syspath;
+	const char *device;
+
+	dev = udev_monitor_receive_device(loop.hotplug);
+	if (!dev)
+		return;
+	action = udev_device_get_action(dev);
+	syspath = udev_device_get_syspath(dev);
+	device = udev_device_get_devnode(dev);
+	if (!action || !syspath || !device)
+		goto out;
+
+	if (strcmp(action, "remove") == 0) {
+		for (size_t i = 0; i < card_count; i++) {
+			if (cards[i].failed || strcmp(cards[i].syspath, syspath))
+				continue;
+			errno = ENODEV;
+			pcimax_card_fail(&cards[i], "device removed");
+		}
+		goto out;
+	}
+	if (strcmp(action, "add") || !pcimax_is_card(dev, serial))
+		goto out;
+
+	/* identify the card by its serial, the port it is connected to
+	 * may have changed */
+	for (size_t i = 0; i < card_count && !card; i++) {
+		if (serial[0] ? strcmp(cards[i].serial, serial) == 0 :
+		    (strcmp(cards[i].syspath, syspath) == 0 ||
+		     strcmp(cards[i].device, device) == 0))
+			card = &cards[i];
+	}
+	if (!card) {
+		/* only take new cards if the cards are auto-detected */
+		if (loop.settings->options[OptSetDevice])
+			goto out;
+		printf("Found pcimax3000+ card at %s\n", device);
+		card = pcimax_card_add(device, syspath);
+		if (card && pcimax_card_open(card, loop.settings))
+			pcimax_card_start(card, loop.settings->options[OptForce]);
+		goto out;
+	}
+	if (!card->failed)
+		goto out;
+	/* keep the path the user gave (e.g. a /dev/serial/by-id link), if
+	 * it still leads to the card */
+	if (!realpath(card->device, real) || strcmp(real, device))
+		snprintf(card->device, sizeof(card->device), "%s", device);
+	snprintf(card->syspath, sizeof(card->syspath), "%s", syspath);
+	pcimax_card_reconnect(card);
+out:
+	udev_device_unref(dev);
+}
+
+/* handles the signals that arrived */
+static void pcimax_loop_signal(void)
+{
+	struct signalfd_siginfo info;
+	int profile;
+
+	while (read(loop.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1 || info.ssi_signo == SIGUSR2) {
+			pcimax_ta_trigger(info.ssi_signo == SIGUSR1,
+					  pcimax_now_us());
+			continue;
+		}
+		if (info.ssi_signo == SIGHUP) {
+			if (loop.settings->options[OptFile]) {
+				printf("Hangup received: Reloading config file\n");
+				pcimax_reload();
+			}
+			continue;
+		}
+		if ((int)info.ssi_signo >= SIGRTMIN &&
+		    (int)info.ssi_signo < SIGRTMIN + PCIMAX_PROFILE_MAX) {
+			profile = info.ssi_signo - SIGRTMIN;
+			if ((size_t)profile >= loop.profile_count) {
+				fprintf(stderr, "No profile %d defined\n", profile);
+				continue;
+			}
+			for (size_t i = 0; i < card_count; i++)
+				if (!cards[i].failed)
+					pcimax_profile_switch(&cards[i], profile);
+			strcpy(loop.profile, loop.profiles[profile].name);
+			continue;
+		}
+		fprintf(stderr, "Interrupt received: Terminating program\n");
+		loop.stop = true;
+	}
+}
+
+/* checks the state of the schedulers of all cards
+ * @busy:	true: is any card sending commands or has commands queued
+ *		false: is any card in the middle of writing a command */
+static bool pcimax_loop_busy(bool queued)
+{
+	for (size_t i = 0; i < card_count; i++) {
+		if (cards[i].failed)
+			continue;
+		if (cards[i].sched.state == PCIMAX_SCHED_WRITING)
+			return true;
+		if (queued && (cards[i].sched.state != PCIMAX_SCHED_IDLE ||
+			       !pcimax_sched_empty(&cards[i].sched)))
+			return true;
+	}
+	return false;
+}
+
+/* dispatches events until the program is terminated, or all commands are
+ * sent if the loop isn't persistent (no monitor / daemon mode). A command
+ * that is partially written is always completed before terminating
+ * @ret_val:	false if the loop failed */
+static bool pcimax_loop_run(void)
+{
+	struct epoll_event events[16];
+	struct pcimax_client *client;
+	struct pcimax_card *card;
+	bool idle;
+	int count;
+
+	while (!loop.stop || pcimax_loop_busy(false)) {
+		pcimax_feed_flush();
+		idle = !pcimax_loop_busy(true);
+		if (loop.batch.file && idle && !loop.stop)
+			pcimax_batch_read();
+		if (loop.feed.file && idle && !loop.stop)
+			pcimax_feed_read();
+		if (!loop.persistent && !pcimax_loop_busy(true))
+			break;
+		/* don't block while a batch / feed file is waiting to be read */
+		count = epoll_wait(loop.epoll_fd, events, 16,
+				   (loop.batch.file || loop.feed.file) && idle ?
+				   0 : -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait: ");
+			return false;
+		}
+		for (int i = 0; i < count; i++) {
+			uint32_t src = events[i].data.u64 & 0xffffffff;
+			uint32_t idx = events[i].data.u64 >> 32;
+
+			switch (src) {
+			case PCIMAX_SRC_SERIAL:
+				card = &cards[idx];
+				if (card->failed)
+					break;
+				if (events[i].events & EPOLLIN)
+					pcimax_sched_answer(card);
+				if ((events[i].events & EPOLLOUT) &&
+				    card->sched.state == PCIMAX_SCHED_WRITING)
+					pcimax_sched_write(card);
+				/* the device is gone */
+				if (!card->failed &&
+				    (events[i].events & (EPOLLERR | EPOLLHUP))) {
+					errno = EIO;
+					pcimax_card_fail(card, "device hung up");
+				}
+				break;
+			case PCIMAX_SRC_TIMER:
+				pcimax_sched_timeout(&cards[idx]);
+				break;
+			case PCIMAX_SRC_SIGNAL:
+				pcimax_loop_signal();
+				break;
+			case PCIMAX_SRC_NOTIFY:
+				if (!pcimax_monitor_handle(loop.notify_fd))
+					loop.stop = true;
+				break;
+			case PCIMAX_SRC_DEBOUNCE:
+				pcimax_monitor_reload();
+				break;
+			case PCIMAX_SRC_LISTEN:
+				pcimax_daemon_accept(loop.listen_fd);
+				break;
+			case PCIMAX_SRC_CLIENT:
+				client = &loop.clients[idx];
+				if (client->fd >= 0)
+					pcimax_daemon_read(client);
+				break;
+			case PCIMAX_SRC_HOTPLUG:
+				pcimax_hotplug_handle();
+				break;
+			case PCIMAX_SRC_FEED:
+				pcimax_feed_read();
+				break;
+			case PCIMAX_SRC_BATCH:
+				pcimax_batch_read();
+				break;
+			case PCIMAX_SRC_TIMETABLE:
+				pcimax_timetable_fire();
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+/* writes a histogram in the Prometheus text format, in seconds */
+static void pcimax_hist_write(FILE *out, const char *name, const char *card,
+			      const struct pcimax_hist *hist)
+{
+	uint64_t count = 0;
+
+	for (size_t i = 0; i < PCIMAX_HIST_BUCKETS; i++) {
+		count += hist->buckets[i];
+		fprintf(out, "%s_bucket{card=\"%s\",le=\"%g\"} %llu\n", name, card,
+			pcimax_hist_bounds[i] / 1000.0, (unsigned long long)count);
+	}
+	fprintf(out, "%s_bucket{card=\"%s\",le=\"+Inf\"} %llu\n", name, card,
+		(unsigned long long)hist->count);
+	fprintf(out, "%s_sum{card=\"%s\"} %.3f\n", name, card, hist->sum_ms / 1000.0);
+	fprintf(out, "%s_count{card=\"%s\"} %llu\n", name, card,
+		(unsigned long long)hist->count);
+}
+
+/* formats the metrics of all cards in the Prometheus text format */
+static void pcimax_metrics_format(FILE *out)
+{
+	const struct pcimax_metrics *metrics;
+	size_t depth;
+
+	#define PCIMAX_METRIC(name, type, help) \
+		fprintf(out, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+	#define PCIMAX_FOREACH_CARD \
+		for (size_t i = 0; i < card_count && (metrics = &cards[i].metrics); i++)
+
+	PCIMAX_METRIC("pcimax_commands_total", "counter",
+		      "Commands sent to the card, by mnemonic");
+	PCIMAX_FOREACH_CARD {
+		for (size_t c = 0; c < metrics->cmd_count; c++)
+			fprintf(out, "pcimax_commands_total{card=\"%s\",cmd=\"%s\"} %llu\n",
+				cards[i].key, metrics->cmds[c].cmd,
+				(unsigned long long)metrics->cmds[c].count);
+	}
+	PCIMAX_METRIC("pcimax_written_bytes_total", "counter",
+		      "Bytes written to the serial line");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_written_bytes_total{card=\"%s\"} %llu\n",
+			cards[i].key, (unsigned long long)metrics->bytes);
+	PCIMAX_METRIC("pcimax_write_errors_total", "counter",
+		      "Failed writes to the serial line");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_write_errors_total{card=\"%s\"} %llu\n",
+			cards[i].key, (unsigned long long)metrics->write_errors);
+	PCIMAX_METRIC("pcimax_partial_writes_total", "counter",
+		      "Writes the serial line didn't take completely");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_partial_writes_total{card=\"%s\"} %llu\n",
+			cards[i].key, (unsigned long long)metrics->partial_writes);
+	PCIMAX_METRIC("pcimax_write_seconds_total", "counter",
+		      "Time spent writing commands");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_write_seconds_total{card=\"%s\"} %.6f\n",
+			cards[i].key, metrics->write_us / 1e6);
+	PCIMAX_METRIC("pcimax_wait_seconds_total", "counter",
+		      "Time spent waiting for the card to process commands");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_wait_seconds_total{card=\"%s\"} %.6f\n",
+			cards[i].key, metrics->wait_us / 1e6);
+	PCIMAX_METRIC("pcimax_queue_depth", "gauge",
+		      "Commands waiting to be sent");
+	PCIMAX_FOREACH_CARD {
+		depth = 0;
+		for (int prio = 0; prio < PCIMAX_PRIO_COUNT; prio++)
+			depth += cards[i].sched.queues[prio].count;
+		fprintf(out, "pcimax_queue_depth{card=\"%s\"} %zu\n",
+			cards[i].key, depth);
+	}
+	PCIMAX_METRIC("pcimax_card_up", "gauge",
+		      "1 if the card is usable");
+	PCIMAX_FOREACH_CARD
+		fprintf(out, "pcimax_card_up{card=\"%s\"} %d\n", cards[i].key,
+			!cards[i].failed);
+	PCIMAX_METRIC("pcimax_queue_delay_seconds", "histogram",
+		      "Time from queueing a command to sending it");
+	PCIMAX_FOREACH_CARD
+		pcimax_hist_write(out, "pcimax_queue_delay_seconds", cards[i].key,
+				  &metrics->queue_delay);
+	PCIMAX_METRIC("pcimax_apply_seconds", "histogram",
+		      "Duration of the updates, until the last command was processed");
+	PCIMAX_FOREACH_CARD
+		pcimax_hist_write(out, "pcimax_apply_seconds", cards[i].key,
+				  &metrics->apply);
+	PCIMAX_METRIC("pcimax_reloads_total", "counter",
+		      "Config file reloads");
+	fprintf(out, "pcimax_reloads_total %llu\n", (unsigned long long)loop.reloads);
+
+	#undef PCIMAX_FOREACH_CARD
+	#undef PCIMAX_METRIC
+}
+
+/* writes the metrics of all cards in the Prometheus text format, the text
+ * is collected first and written at once
+ * @ret_val:	false on error */
+static bool pcimax_metrics_write(int fd)
+{
+	char *text = NULL;
+	size_t len = 0;
+	ssize_t wr_count;
+	FILE *out;
+	bool ok = true;
+
+	out = open_memstream(&text, &len);
+	if (!out)
+		return false;
+	pcimax_metrics_format(out);
+	if (fclose(out))
+		return false;
+	for (size_t pos = 0; pos < len; pos += wr_count) {
+		wr_count = write(fd, text + pos, len - pos);
+		if (wr_count < 0 && errno == EINTR) {
+			wr_count = 0;
+			continue;
+		}
+		if (wr_count < 0) {
+			ok = false;
+			break;
+		}
+	}
+	free(text);
+	return ok;
+}
+
+/* rewrites the metrics file (--metrics), the new contents are renamed into
+ * place, so that a collector never reads a partial file */
+static void pcimax_metrics_save(void)
+{
+	const char *path = loop.settings ? loop.settings->metrics : "";
+	char tmp[PATH_MAX];
+	bool written;
+	int fd;
+
+	if (!path[0])
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("Unable to write the metrics file");
+		return;
+	}
+	written = pcimax_metrics_write(fd);
+	if (close(fd) < 0 || !written || rename(tmp, path) < 0) {
+		perror("Unable to write the metrics file");
+		unlink(tmp);
+	}
+}
+
+/* prints the status of each card, if several cards are controlled
+ * @start:	time at which the program started to send commands */
+static void pcimax_report(int64_t start)
+{
+	size_t ok = 0;
+
+	if (card_count < 2)
+		return;
+	printf("\n");
+	for (size_t i = 0; i < card_count; i++) {
+		if (cards[i].failed) {
+			printf("Card %s at %s: failed, %s\n", cards[i].key,
+			       cards[i].device, cards[i].error);
+			continue;
+		}
+		printf("Card %s at %s: ok, %u commands in %lld ms\n",
+		       cards[i].key, cards[i].device, cards[i].total_sent,
+		       (long long)cards[i].busy_ms);
+		ok++;
+	}
+	printf("%zu of %zu cards ok, %lld ms in total\n", ok, card_count,
+	       (long long)(pcimax_now_ms() - start));
+}
+
+/* connects to the control socket of a running daemon
+ * @ret_val:	connected socket, -1 if no daemon is running */
+static int pcimax_client_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* sends a request to the daemon and prints the answer
+ * @ret_val:	true if the daemon answered "ok" */
+static bool pcimax_client_request(int sock, FILE *stream, const char *request)
+{
+	char line[PCIMAX_LINE_MAX];
+
+	dprintf(sock, "%s\n", request);
+	while (fgets(line, sizeof(line), stream)) {
+		if (strcmp(line, "ok\n") == 0)
+			return true;
+		if (strncmp(line, "error", 5) == 0) {
+			fprintf(stderr, "Daemon: %s", line);
+			return false;
+		}
+		printf("%s", line);
+	}
+	fprintf(stderr, "Daemon closed the connection\n");
+	return false;
+}
+
+/* passes the requests of the command line for one card (all cards if
+ * @device is NULL) on to the running daemon
+ * @ret_val:	false if the daemon refused a request */
+static bool pcimax_client_card(int sock, FILE *stream,
+			       const struct pcimax_settings *settings,
+			       const char *device)
+{
+	const struct pcimax_key *key;
+	char request[PCIMAX_LINE_MAX + PCIMAX_KEY_MAX];
+	char value[PCIMAX_LINE_MAX];
+	bool ok = true;
+
+	/* address only the given card */
+	if (device) {
+		snprintf(request, sizeof(request), "card %s", device);
+		ok = pcimax_client_request(sock, stream, request);
+	}
+	for (key = pcimax_keys; key->name && ok; key++) {
+		if (!(settings->values.defined & key->bit))
+			continue;
+		key->format(&settings->values, key, value);
+		snprintf(request, sizeof(request), "set %s=%s", key->name, value);
+		ok = pcimax_client_request(sock, stream, request);
+	}
+	if (ok && settings->values.defined)
+		ok = pcimax_client_request(sock, stream, "apply");
+	if (ok && settings->options[OptProfile]) {
+		snprintf(request, sizeof(request), "profile %s", settings->profile);
+		ok = pcimax_client_request(sock, stream, request);
+	}
+	if (ok && settings->options[OptGet]) {
+		if (strcmp(settings->get, "all") == 0)
+			strcpy(request, "get");
+		else
+			snprintf(request, sizeof(request), "get %s", settings->get);
+		ok = pcimax_client_request(sock, stream, request);
+	}
+	return ok;
+}
+
+/* passes the settings from the command line / config file on to the
+ * running daemon instead of accessing the card directly, once for every
+ * given card
+ * @ret_val:	exit code of the program */
+static int pcimax_client_run(int sock, const struct pcimax_settings *settings)
+{
+	bool ok = true;
+	FILE *stream;
+
+	/* the daemon sends with its own delay and keeps track of what the
+	 * cards have, these can't be passed on */
+	if (settings->options[OptForce] || settings->options[OptDelay]) {
+		fprintf(stderr, "--force and --delay can't be passed on to the "
+			"daemon running on %s\n", settings->socket);
+		close(sock);
+		return 1;
+	}
+	stream = fdopen(sock, "r");
+	if (!stream)
+		return 1;
+	if (!card_count)
+		ok = pcimax_client_card(sock, stream, settings, NULL);
+	for (size_t i = 0; i < card_count && ok; i++)
+		ok = pcimax_client_card(sock, stream, settings, cards[i].device);
+	fclose(stream);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	static struct pcimax_settings settings;
+	int64_t start;
+	size_t usable = 0;
+	bool ok;
+	int profile;
+	int sock;
+	memset(&settings, 0, sizeof(settings));
+	startup.start = pcimax_now_ms();
+
+	/* set up the program settings */
+	pcimax_parse_cl(argc, argv, &settings);
+
+	/* if a ini file was specified, load the values from the file */
+	if (settings.options[OptFile]) {
+		ini_parse(settings.file, pcimax_ini_cb, &settings.values);
+	}
+
+	/* hand the settings to the daemon if one is running */
+	if (!settings.options[OptSocket])
+		strcpy(settings.socket, PCIMAX_SOCKET);
+	if (!settings.options[OptDaemon] && !settings.options[OptMonitor] &&
+	    !settings.options[OptCalibrate] && !settings.options[OptFeed] &&
+	    !settings.options[OptBatch] &&
+	    !settings.options[OptDryRun]) {
+		sock = pcimax_client_connect(settings.socket);
+		if (sock >= 0)
+			return pcimax_client_run(sock, &settings);
+		if (settings.options[OptGet]) {
+			fprintf(stderr, "No daemon running on %s\n", settings.socket);
+			exit(1);
+		}
+	}
+
+	/* if no device was specified, try to auto-detect the cards, a dry
+	 * run doesn't touch the device cache of the state directory */
+	if (!card_count)
+		pcimax_find_devices(settings.options[OptRescan] ||
+				    settings.options[OptDryRun] ?
+				    NULL : pcimax_state_dir(&settings));
+	startup.discovered = pcimax_now_ms();
+
+	/* open the devices(com ports) and configure them */
+	if (settings.options[OptDelay])
+		cmd_delay = settings.delay;
+	/* the profiles of the config file are compiled when the cards are
+	 * opened, the cards start in the selected one */
+	if (settings.options[OptFile])
+		pcimax_profiles_load(settings.file);
+	if (settings.options[OptProfile]) {
+		profile = pcimax_profile_find(settings.profile);
+		if (profile < 0) {
+			fprintf(stderr, "Unknown profile %s\n", settings.profile);
+			pcimax_exit();
+		}
+		strcpy(loop.profile, loop.profiles[profile].name);
+	}
+	pcimax_loop_init(&settings);
+	for (size_t i = 0; i < card_count; i++) {
+		if (pcimax_card_open(&cards[i], &settings))
+			usable++;
+	}
+	if (!usable)
+		pcimax_exit();
+	startup.setup = pcimax_now_ms();
+
+	if (settings.options[OptCalibrate]) {
+		bool calibrated = true;
+
+		for (size_t i = 0; i < card_count && !loop.stop; i++) {
+			if (cards[i].failed) {
+				calibrated = false;
+				continue;
+			}
+			/* the card got the probes, some of them possibly
+			 * garbled, its state is unknown now */
+			pcimax_state_forget(&cards[i]);
+			if (pcimax_calibrate(&cards[i], settings.verify) &&
+			    pcimax_timing_save(&cards[i], pcimax_state_dir(&settings)))
+				continue;
+			calibrated = false;
+		}
+		if (!calibrated)
+			pcimax_exit();
+		pcimax_close_cards();
+		return 0;
+	}
+	if (settings.options[OptDryRun]) {
+		for (size_t i = 0; i < card_count; i++) {
+			if (!cards[i].failed)
+				pcimax_card_dry_run(&cards[i],
+						    settings.options[OptForce]);
+		}
+		pcimax_close_cards();
+		return 0;
+	}
+
+	/* start serving requests and watching the config file right away,
+	 * changes are picked up while the initial settings are sent */
+	if (settings.options[OptDaemon]) {
+		sock = pcimax_daemon_listen(settings.socket);
+		if (sock < 0 || !pcimax_loop_listen(sock))
+			pcimax_exit();
+	}
+	if (settings.options[OptDebounce])
+		loop.debounce = settings.debounce;
+	if (settings.options[OptMonitor] && !pcimax_loop_monitor(settings.file))
+		pcimax_exit();
+	if (settings.options[OptFeed] && !pcimax_loop_feed(settings.feed))
+		pcimax_exit();
+	if (settings.options[OptBatch] && !pcimax_loop_batch(settings.batch))
+		pcimax_exit();
+	/* the [schedule] section needs a program that keeps running */
+	if (settings.options[OptFile] && (settings.options[OptMonitor] ||
+					  settings.options[OptDaemon]) &&
+	    !pcimax_loop_timetable(settings.file))
+		pcimax_exit();
+	/* keep the cards on air when their USB link is reset */
+	if (loop.persistent)
+		pcimax_hotplug_init();
+
+	/* update all defined RDS values, that the cards don't have yet,
+	 * all cards are updated in parallel */
+	start = pcimax_now_ms();
+	for (size_t i = 0; i < card_count; i++) {
+		if (!cards[i].failed)
+			pcimax_card_start(&cards[i], settings.options[OptForce]);
+	}
 	
-	/* if the monitor option was selected, enter the watch loop */
-	if (settings.options[OptMonitor])
-		pcimax_monitor_loop(fd, &settings);
+	if (settings.options[OptDaemon])
+		printf("Waiting for requests, end program with ctrl+c\n");
+	else if (settings.options[OptMonitor])
+		printf("\n Monitoring config file for changes\n"
+		       "End program with ctrl+c\n");
+	/* send the settings, and serve requests as daemon / watch the
+	 * config file if selected */
+	ok = pcimax_loop_run();
+	pcimax_report(start);
+	pcimax_metrics_save();
+	if (settings.options[OptDaemon]) {
+		close(sock);
+		unlink(settings.socket);
+	}
+
+	/* a card that failed on the way didn't get all settings, unless the
+	 * program kept running to take it back (monitor / daemon mode) */
+	for (size_t i = 0; i < card_count; i++) {
+		if (cards[i].failed && !loop.persistent)
+			ok = false;
+	}
 
 	/* restore com port settings & close the program  */
-	pcimax_exit(fd, true);
-	return 1;
+	if (!ok)
+		pcimax_exit();
+	pcimax_close_cards();
+	return 0;
 };
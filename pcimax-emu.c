@@ -0,0 +1,636 @@
+/*
+ * pcimax-emu: emulates a pcimax3000+ card on a pseudo terminal, so that
+ * pcimax-ctl can be run and measured without the hardware
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA  02110-1335  USA
+ */
+
+#define _GNU_SOURCE	/* posix_openpt, ptsname */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/signalfd.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+
+/* control characters of the serial protocol:
+ * 0x00 <command> 0x01 <data> 0x02 */
+#define PCIMAX_FRAME_START	0x00
+#define PCIMAX_FRAME_DATA	0x01
+#define PCIMAX_FRAME_END	0x02
+/* data values are sent with an offset, to keep them apart from the
+ * control characters */
+#define PCIMAX_OFFSET		4
+#define PCIMAX_CMD_MAX		8
+#define PCIMAX_DATA_MAX		128
+#define PCIMAX_AF_MAX		7
+#define PCIMAX_PS_SLOTS		40
+
+/* short options */
+enum Options {
+	OptHelp = 'h',
+	OptVerbose = 'v',
+	OptAnswer = 64,
+	OptBusy,
+	OptLink,
+	OptStats,
+	OptLast = 128
+};
+
+/* long options */
+static struct option long_options[] = {
+	{"answer", no_argument, 0, OptAnswer},
+	{"busy", required_argument, 0, OptBusy},
+	{"help", no_argument, 0, OptHelp},
+	{"link", required_argument, 0, OptLink},
+	{"stats", required_argument, 0, OptStats},
+	{"verbose", no_argument, 0, OptVerbose},
+	{0, 0, 0, 0}
+};
+
+/* model of the card state, as far as it can be set over the serial line */
+struct pcimax_emu_card {
+	/** FM settings **/
+	char stereo;		/* '0' mono, '1' stereo */
+	uint32_t freq;		/* kHz */
+	uint8_t power;		/* power level 0..21 */
+	uint32_t fm_commits;	/* number of FW commands */
+	/** RDS settings **/
+	bool rds_on;
+	uint8_t pi[2];		/* CCAC / PREF */
+	char pty[3];
+	char tp;
+	char ta;
+	char ms;
+	char di[4];		/* Did0..Did3 */
+	uint8_t af_count;
+	uint32_t af[PCIMAX_AF_MAX];	/* kHz, 0 = unused */
+	uint8_t ecc;		/* 1..5 -> E0..E4 */
+	char rt[65];
+	char ps[PCIMAX_PS_SLOTS][9];	/* PS00 is the static PS */
+	char pd[PCIMAX_PS_SLOTS];	/* display time of the dynamic PS slots */
+};
+
+/* statistics of the received data */
+struct pcimax_emu_stats {
+	uint32_t frames;	/* commands that were accepted */
+	uint32_t rejected;	/* commands received while the card was busy */
+	uint32_t malformed;	/* broken frames, unknown commands, bad data */
+	uint64_t bytes;		/* bytes received */
+	int64_t last_byte_us;	/* wall clock time of the last byte (us) */
+	int64_t first;		/* time of the first / last command (ms) */
+	int64_t last;
+};
+
+/* receive state of the frame parser */
+struct pcimax_emu_frame {
+	enum {
+		PCIMAX_FRAME_IDLE,	/* waiting for 0x00 */
+		PCIMAX_FRAME_CMD,	/* reading the command name */
+		PCIMAX_FRAME_PAYLOAD,	/* reading the data */
+	} state;
+	char cmd[PCIMAX_CMD_MAX + 1];
+	size_t cmd_len;
+	uint8_t data[PCIMAX_DATA_MAX];
+	size_t data_len;
+	bool overflow;
+	/* copy of the raw frame, used as the answer of the card */
+	uint8_t raw[PCIMAX_CMD_MAX + PCIMAX_DATA_MAX + 3];
+	size_t raw_len;
+};
+
+static struct pcimax_emu_card card;
+static struct pcimax_emu_stats stats;
+static bool verbose;
+static bool answer;
+static uint32_t busy_ms;
+static int64_t busy_until;
+static const char *stats_file;
+
+/* returns a monotonic timestamp in ms */
+static int64_t pcimax_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void pcimax_usage(void)
+{
+	printf("pcimax-emu: emulates a pcimax3000+ card on a pseudo terminal\n"
+	       "use the printed (or linked) device with pcimax-ctl --device\n"
+	       "  --link=<path>\n"
+	       "                     create a symlink to the pseudo terminal\n"
+	       "  --busy=<ms>\n"
+	       "                     time the card needs to process a command,\n"
+	       "                     commands arriving earlier are rejected\n"
+	       "                     default: 0\n"
+	       "  --answer\n"
+	       "                     echo every accepted command, once it was\n"
+	       "                     processed\n"
+	       "  --stats=<path>\n"
+	       "                     keep the counters in a file, updated on\n"
+	       "                     every received data (used by make bench)\n"
+	       "  -v, --verbose\n"
+	       "                     print every decoded command\n"
+	       "  -h, --help\n"
+	       "                     display this help message\n"
+	       "SIGUSR1 prints the card state, it is printed on exit as well\n");
+}
+
+/* decodes a value that was sent with the offset
+ * @ret_val:	-1 if the byte is out of range */
+static int pcimax_decode_byte(uint8_t value)
+{
+	return (value < PCIMAX_OFFSET) ? -1 : value - PCIMAX_OFFSET;
+}
+
+/* inverse of pcimax_get_freq: low byte, high byte, both holding 7 bits of
+ * the frequency in 5kHz steps */
+static bool pcimax_decode_freq(const uint8_t *data, size_t len, uint32_t *freq)
+{
+	int low, high;
+
+	if (len != 2)
+		return false;
+	low = pcimax_decode_byte(data[0]);
+	high = pcimax_decode_byte(data[1]);
+	if (low < 0 || low > 127 || high < 0)
+		return false;
+	*freq = (uint32_t)(high * 128 + low) * 5;
+	return *freq >= 87500 && *freq <= 108000;
+}
+
+/* inverse of pcimax_get_af_code, 87.5MHz + 0.1MHz per step */
+static bool pcimax_decode_af(uint8_t value, uint32_t *freq)
+{
+	int code = pcimax_decode_byte(value);
+
+	if (code < 1 || code > 205)
+		return false;
+	*freq = 87500 + (uint32_t)code * 100;
+	return true;
+}
+
+/* parses a 3 digit decimal value (PI bytes) */
+static bool pcimax_decode_dec(const uint8_t *data, size_t len, uint8_t *value)
+{
+	unsigned int result = 0;
+
+	if (len != 3)
+		return false;
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] < '0' || data[i] > '9')
+			return false;
+		result = result * 10 + data[i] - '0';
+	}
+	if (result > 255)
+		return false;
+	*value = (uint8_t)result;
+	return true;
+}
+
+/* ASCII flag '0' / '1' */
+static bool pcimax_decode_flag(const uint8_t *data, size_t len, char *flag)
+{
+	if (len != 1 || (data[0] != '0' && data[0] != '1'))
+		return false;
+	*flag = (char)data[0];
+	return true;
+}
+
+/* parses the slot number of the PSxx / PDxx commands */
+static int pcimax_decode_slot(const char *cmd)
+{
+	if (strlen(cmd) != 4 || cmd[2] < '0' || cmd[2] > '9' ||
+	    cmd[3] < '0' || cmd[3] > '9')
+		return -1;
+	return (cmd[2] - '0') * 10 + cmd[3] - '0';
+}
+
+/* text fields are overwritten from the start, the card doesn't clear the
+ * rest of the field (see the RT comment in pcimax-ctl) */
+static void pcimax_store_text(char *field, size_t size, const uint8_t *data,
+			      size_t len)
+{
+	size_t old_len = strlen(field);
+
+	if (len > size - 1)
+		len = size - 1;
+	memcpy(field, data, len);
+	if (len > old_len)
+		field[len] = '\0';
+}
+
+/* applies a decoded command to the card model
+ * @ret_val:	false if the command is unknown or its data is invalid */
+static bool pcimax_emu_command(const char *cmd, const uint8_t *data, size_t len)
+{
+	uint32_t freq;
+	int value;
+	int slot;
+
+	if (strcmp(cmd, "FF") == 0) {
+		if (!pcimax_decode_freq(data, len, &freq))
+			return false;
+		card.freq = freq;
+		if (verbose)
+			printf("FF  frequency %.2fMHz\n", freq / 1000.0f);
+	} else if (strcmp(cmd, "FO") == 0) {
+		value = (len == 1) ? pcimax_decode_byte(data[0]) : -1;
+		if (value < 0 || value > 21)
+			return false;
+		card.power = (uint8_t)value;
+		if (verbose)
+			printf("FO  power level %d/21\n", value);
+	} else if (strcmp(cmd, "FS") == 0) {
+		if (!pcimax_decode_flag(data, len, &card.stereo))
+			return false;
+		if (verbose)
+			printf("FS  %s\n", card.stereo == '1' ? "stereo" : "mono");
+	} else if (strcmp(cmd, "FW") == 0) {
+		card.fm_commits++;
+		if (verbose)
+			printf("FW  FM settings stored\n");
+	} else if (strcmp(cmd, "PWR") == 0) {
+		card.rds_on = true;
+		if (verbose)
+			printf("PWR RDS output enabled\n");
+	} else if (strcmp(cmd, "CCAC") == 0 || strcmp(cmd, "PREF") == 0) {
+		if (!pcimax_decode_dec(data, len, &card.pi[cmd[0] == 'P']))
+			return false;
+		if (verbose)
+			printf("%s PI 0x%02x%02x\n", cmd, card.pi[0], card.pi[1]);
+	} else if (strcmp(cmd, "PTY") == 0) {
+		if (len < 1 || len > 2)
+			return false;
+		memcpy(card.pty, data, len);
+		card.pty[len] = '\0';
+		if (verbose)
+			printf("PTY %s\n", card.pty);
+	} else if (strcmp(cmd, "TP") == 0 || strcmp(cmd, "TA") == 0 ||
+		   strcmp(cmd, "MS") == 0) {
+		char *flag = (cmd[0] == 'M') ? &card.ms :
+			     (cmd[1] == 'P') ? &card.tp : &card.ta;
+		if (!pcimax_decode_flag(data, len, flag))
+			return false;
+		if (verbose)
+			printf("%s  %c\n", cmd, *flag);
+	} else if (strncmp(cmd, "Did", 3) == 0 && cmd[3] >= '0' && cmd[3] <= '3' &&
+		   !cmd[4]) {
+		if (!pcimax_decode_flag(data, len, &card.di[cmd[3] - '0']))
+			return false;
+		if (verbose)
+			printf("%s %c\n", cmd, card.di[cmd[3] - '0']);
+	} else if (strcmp(cmd, "AF0") == 0) {
+		value = (len == 1) ? pcimax_decode_byte(data[0]) - 224 : -1;
+		if (value < 0 || value > PCIMAX_AF_MAX)
+			return false;
+		card.af_count = (uint8_t)value;
+		if (verbose)
+			printf("AF0 %d alternative frequencies\n", value);
+	} else if (strncmp(cmd, "AF", 2) == 0 && cmd[2] >= '1' && cmd[2] <= '7' &&
+		   !cmd[3]) {
+		/* unused entries are set to "0" */
+		if (len != 1)
+			return false;
+		if (data[0] == '0')
+			freq = 0;
+		else if (!pcimax_decode_af(data[0], &freq))
+			return false;
+		card.af[cmd[2] - '1'] = freq;
+		if (verbose)
+			printf("%s %.1fMHz\n", cmd, freq / 1000.0f);
+	} else if (strcmp(cmd, "ECC") == 0) {
+		value = (len == 1) ? pcimax_decode_byte(data[0]) : -1;
+		if (value < 1 || value > 5)
+			return false;
+		card.ecc = (uint8_t)value;
+		if (verbose)
+			printf("ECC E%d\n", value - 1);
+	} else if (strcmp(cmd, "RT") == 0) {
+		if (len > 64)
+			return false;
+		pcimax_store_text(card.rt, sizeof(card.rt), data, len);
+		if (verbose)
+			printf("RT  \"%.*s\"\n", (int)len, (const char *)data);
+	} else if (strncmp(cmd, "PS", 2) == 0 || strncmp(cmd, "PD", 2) == 0) {
+		slot = pcimax_decode_slot(cmd);
+		if (slot < 0 || slot >= PCIMAX_PS_SLOTS || len < 1)
+			return false;
+		if (cmd[1] == 'D') {
+			card.pd[slot] = (char)data[0];
+		} else if (len == 4 && memcmp(data, "NULL", 4) == 0) {
+			/* clears a dynamic PS slot */
+			card.ps[slot][0] = '\0';
+		} else {
+			if (len > 8)
+				return false;
+			pcimax_store_text(card.ps[slot], sizeof(card.ps[slot]),
+					  data, len);
+		}
+		if (verbose)
+			printf("%s \"%.*s\"\n", cmd, (int)len, (const char *)data);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* prints the current card model */
+static void pcimax_emu_dump(void)
+{
+	int64_t span = stats.last - stats.first;
+
+	printf("--- card state ---\n");
+	printf("FM:  %.2fMHz, power level %u/21, %s, stored %u times\n",
+	       card.freq / 1000.0f, card.power,
+	       card.stereo == '1' ? "stereo" : "mono", card.fm_commits);
+	printf("RDS: %s, PI 0x%02x%02x, PTY %s, TP %c, TA %c, MS %c, "
+	       "DI %.4s, ECC E%d\n",
+	       card.rds_on ? "on" : "off", card.pi[0], card.pi[1], card.pty,
+	       card.tp ? card.tp : '-', card.ta ? card.ta : '-',
+	       card.ms ? card.ms : '-', card.di, card.ecc ? card.ecc - 1 : 0);
+	printf("AF:  %u defined:", card.af_count);
+	for (int i = 0; i < PCIMAX_AF_MAX; i++)
+		printf(" %.1f", card.af[i] / 1000.0f);
+	printf("\nRT:  \"%s\"\nPS:  \"%s\"\n", card.rt, card.ps[0]);
+	for (int i = 1; i < PCIMAX_PS_SLOTS; i++) {
+		if (card.ps[i][0])
+			printf("PS%02d \"%s\", display %c\n", i, card.ps[i],
+			       card.pd[i] ? card.pd[i] : '-');
+	}
+	printf("%u commands (%llu bytes) in %lld ms, %u rejected (busy), "
+	       "%u malformed\n", stats.frames, (unsigned long long)stats.bytes,
+	       (long long)(stats.frames ? span : 0), stats.rejected,
+	       stats.malformed);
+	fflush(stdout);
+}
+
+/* rewrites the statistics file (key value lines), atomically so that a
+ * reader never sees a partial file */
+static void pcimax_emu_stats_write(void)
+{
+	char tmp[PATH_MAX];
+	FILE *file;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", stats_file);
+	file = fopen(tmp, "w");
+	if (!file)
+		return;
+	fprintf(file, "commands %u\nbytes %llu\nrejected %u\nmalformed %u\n"
+		"last_byte_us %lld\n", stats.frames,
+		(unsigned long long)stats.bytes, stats.rejected,
+		stats.malformed, (long long)stats.last_byte_us);
+	if (fclose(file) || rename(tmp, stats_file))
+		unlink(tmp);
+}
+
+/* handles a complete frame, commands that arrive while the card is still
+ * processing the previous one are rejected
+ * @ret_val:	true if the command was accepted */
+static bool pcimax_emu_frame(struct pcimax_emu_frame *frame)
+{
+	int64_t now = pcimax_now_ms();
+
+	if (busy_ms && now < busy_until) {
+		stats.rejected++;
+		if (verbose)
+			printf("%s rejected, card busy for another %lld ms\n",
+			       frame->cmd, (long long)(busy_until - now));
+		return false;
+	}
+	if (frame->overflow ||
+	    !pcimax_emu_command(frame->cmd, frame->data, frame->data_len)) {
+		stats.malformed++;
+		printf("Malformed command '%s' with %zu data bytes\n",
+		       frame->cmd, frame->data_len);
+		return false;
+	}
+	if (!stats.frames)
+		stats.first = now;
+	stats.last = now;
+	stats.frames++;
+	busy_until = now + busy_ms;
+	return true;
+}
+
+/* feeds received bytes into the frame parser
+ * @pending:	receives the answer of the last accepted command */
+static void pcimax_emu_receive(struct pcimax_emu_frame *frame,
+			       const uint8_t *buf, size_t len,
+			       struct pcimax_emu_frame *pending, bool *has_pending)
+{
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = buf[i];
+
+		if (c == PCIMAX_FRAME_START) {
+			/* a frame start inside a frame, e.g. a 0x00 byte in
+			 * the data, the unfinished command is lost */
+			if (frame->state != PCIMAX_FRAME_IDLE) {
+				stats.malformed++;
+				printf("Incomplete command '%s' dropped\n",
+				       frame->cmd);
+			}
+			memset(frame, 0, sizeof(*frame));
+			frame->state = PCIMAX_FRAME_CMD;
+		} else if (frame->state == PCIMAX_FRAME_IDLE) {
+			/* garbage between frames */
+			stats.malformed++;
+			continue;
+		} else if (frame->state == PCIMAX_FRAME_CMD &&
+			   c == PCIMAX_FRAME_DATA) {
+			frame->state = PCIMAX_FRAME_PAYLOAD;
+		} else if (frame->state == PCIMAX_FRAME_CMD) {
+			if (frame->cmd_len < PCIMAX_CMD_MAX)
+				frame->cmd[frame->cmd_len++] = (char)c;
+			else
+				frame->overflow = true;
+		} else if (c == PCIMAX_FRAME_END) {
+			frame->raw[frame->raw_len++] = c;
+			if (pcimax_emu_frame(frame) && answer) {
+				*pending = *frame;
+				*has_pending = true;
+			}
+			frame->state = PCIMAX_FRAME_IDLE;
+			continue;
+		} else if (frame->data_len < PCIMAX_DATA_MAX) {
+			frame->data[frame->data_len++] = c;
+		} else {
+			frame->overflow = true;
+		}
+		if (frame->raw_len < sizeof(frame->raw))
+			frame->raw[frame->raw_len++] = c;
+	}
+}
+
+/* creates the pseudo terminal, the slave side is kept open so that the
+ * master doesn't see a hangup when pcimax-ctl closes the device
+ * @ret_val:	file descriptor of the master side */
+static int pcimax_emu_open(const char *link, int *slave)
+{
+	struct termios tio;
+	const char *name;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("Can't create pseudo terminal");
+		exit(1);
+	}
+	name = ptsname(master);
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	if (*slave < 0) {
+		perror("Can't open pseudo terminal");
+		exit(1);
+	}
+	/* raw mode, like the virtual com port of the card */
+	tcgetattr(*slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(*slave, TCSANOW, &tio);
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link) < 0) {
+			perror("Can't create link to the pseudo terminal");
+			exit(1);
+		}
+		printf("Emulating pcimax3000+ card at %s (%s)\n", link, name);
+	} else {
+		printf("Emulating pcimax3000+ card at %s\n", name);
+	}
+	fflush(stdout);
+	return master;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pcimax_emu_frame frame, pending;
+	bool has_pending = false;
+	struct signalfd_siginfo info;
+	struct pollfd fds[2];
+	const char *link = NULL;
+	struct timespec ts;
+	uint8_t buf[256];
+	sigset_t mask;
+	int master, slave;
+	int timeout;
+	ssize_t len;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hv", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OptAnswer:
+			answer = true;
+			break;
+		case OptBusy:
+			busy_ms = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case OptLink:
+			link = optarg;
+			break;
+		case OptStats:
+			stats_file = optarg;
+			break;
+		case OptVerbose:
+			verbose = true;
+			break;
+		case OptHelp:
+			pcimax_usage();
+			exit(0);
+		default:
+			pcimax_usage();
+			exit(1);
+		}
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	master = pcimax_emu_open(link, &slave);
+	if (stats_file)
+		pcimax_emu_stats_write();
+	memset(&frame, 0, sizeof(frame));
+	fds[0].fd = master;
+	fds[0].events = POLLIN;
+	fds[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		/* the answer goes out once the command was processed */
+		timeout = -1;
+		if (has_pending) {
+			timeout = (int)(busy_until - pcimax_now_ms());
+			if (timeout <= 0) {
+				if (write(master, pending.raw, pending.raw_len) < 0)
+					perror("Can't send answer");
+				has_pending = false;
+				continue;
+			}
+		}
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			if (read(fds[1].fd, &info, sizeof(info)) != sizeof(info))
+				continue;
+			if (info.ssi_signo == SIGUSR1) {
+				pcimax_emu_dump();
+				continue;
+			}
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			len = read(master, buf, sizeof(buf));
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("Read error");
+				break;
+			}
+			if (len > 0) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				stats.bytes += (size_t)len;
+				stats.last_byte_us = (int64_t)ts.tv_sec * 1000000 +
+						     ts.tv_nsec / 1000;
+				pcimax_emu_receive(&frame, buf, (size_t)len,
+						   &pending, &has_pending);
+				if (stats_file)
+					pcimax_emu_stats_write();
+			}
+		}
+	}
+
+	pcimax_emu_dump();
+	if (link)
+		unlink(link);
+	close(slave);
+	close(master);
+	return 0;
+}
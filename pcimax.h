@@ -0,0 +1,327 @@
+/*
+ * Copyright 2012 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ * Author: Konke Radlow <koradlow@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA  02110-1335  USA
+ */
+
+/* libpcimax: controls pcimax3000+ FM / RDS cards over their serial line
+ *
+ * the library keeps no state of its own, everything lives in the handles
+ * and the structs of the caller, and it never prints or exits. Functions
+ * that can fail return 0 on success and a negative errno value otherwise.
+ *
+ * simple use, every call blocks until the card took the commands:
+ *   struct pcimax *card;
+ *   if (pcimax_open("/dev/ttyUSB0", &card) == 0) {
+ *           pcimax_set(card, "rt", "Artist - Title");
+ *           pcimax_close(card);
+ *   }
+ * callers with their own event loop use the building blocks below the
+ * handle API: the settings table, the command plans and the serial line
+ * setup, as pcimax-ctl does */
+
+#ifndef PCIMAX_H
+#define PCIMAX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* define bits for bitmask that defines the settings that the user wants
+ * to update */
+#define PCIMAX_FM	0x01	/* FM related setting change requested */
+#define PCIMAX_RDS	0x02	/* RDS related setting change requested */
+#define PCIMAX_FREQ	0x10
+#define PCIMAX_PWR	0x20
+#define PCIMAX_STEREO	0x40
+#define PCIMAX_AF	0x80
+#define PCIMAX_RT	0x100
+#define PCIMAX_PI	0x200
+#define PCIMAX_PTY	0x400
+#define PCIMAX_PTYT	0x800
+#define PCIMAX_TP	0x1000
+#define PCIMAX_TA	0x2000
+#define PCIMAX_MS	0x4000
+#define PCIMAX_PS	0x8000
+#define PCIMAX_ECC	0x10000
+#define PCIMAX_DI	0x20000
+#define PCIMAX_PS_SLOTS	0x40000	/* dynamic PS slots & delays disabled */
+
+/* all field bits that belong to the FM / RDS group */
+#define PCIMAX_FM_FIELDS	(PCIMAX_FREQ | PCIMAX_PWR | PCIMAX_STEREO)
+#define PCIMAX_RDS_FIELDS	(PCIMAX_AF | PCIMAX_RT | PCIMAX_PI | PCIMAX_PTY | \
+				 PCIMAX_PTYT | PCIMAX_TP | PCIMAX_TA | PCIMAX_MS | \
+				 PCIMAX_PS | PCIMAX_ECC | PCIMAX_DI | PCIMAX_PS_SLOTS)
+
+/* upper bound for the delay after a command, if the card doesn't respond
+ * earlier. 200ms is used in official program */
+#define PCIMAX_DEFAULT_DELAY	200
+/* fixed speed of the serial line, 8N1 -> 10 bits per byte */
+#define PCIMAX_BAUD		9600
+/* time without further response bytes after which an answer of the card
+ * is considered complete (~5 chars @ 9600 baud) */
+#define PCIMAX_QUIET_MS		5
+
+/* USB to serial IC of the card (CP2102) */
+#define PCIMAX_VENDOR_ID	"10c4"
+#define PCIMAX_PRODUCT_ID	"ea60"
+/* stable names of the USB serial devices */
+#define PCIMAX_BY_ID_DIR	"/dev/serial/by-id"
+#define PCIMAX_SERIAL_MAX	80
+
+/* values of all settings of a card */
+struct pcimax_values {
+	uint32_t defined;	/* bitmask denoting all defined settings */
+
+	/** FM-Transmitter settings **/
+	uint32_t freq;	/* range 87500..108000 */
+	uint8_t power; 	/* range 0..100 */
+	char is_stereo;
+
+	/** RDS settings **/
+	/* fields are stored as chars to ease transmission over serial line */
+	uint8_t pi[2];
+	uint32_t af[7];		/* Alternative Frequencies, range 87500..10800 */
+	uint8_t af_size;	/* number of defined AFs */
+	char rt[65];		/* Null-terminated string */
+	char pty[3];		/* Null-terminated string */
+	char ps[9];		/* Null-terminated string */
+	char ecc;		/* Extended country code */
+	char tp;		/* Traffic Program flag */
+	char ta;		/* Traffic Announcement flag */
+	char ms;		/* music / speech flag */
+	/* decoder information fields */
+	char di_artificial; 	/* artificial head */
+	char di_compression;	/* compressed transmission flag */
+	char di_dynamic_pty;	/* dynamic program type */
+};
+
+/* limits of a single command frame */
+#define PCIMAX_CMD_MAX		4	/* longest command, e.g. "CCAC" */
+/* the cards use the values 0x00, 0x01 and 0x02 as control characters,
+ * numeric data is sent with this offset added */
+#define PCIMAX_DATA_OFFSET	4
+#define PCIMAX_DATA_MAX		64	/* longest payload, the RT */
+#define PCIMAX_FRAME_MAX	(PCIMAX_CMD_MAX + PCIMAX_DATA_MAX + 3)
+/* a full update of all settings takes 107 commands */
+#define PCIMAX_PLAN_MAX		128
+
+/* a single command, framed as it is sent over the serial line */
+struct pcimax_frame {
+	uint32_t field;		/* PCIMAX_* bit of the setting */
+	uint8_t len;
+	char buf[PCIMAX_FRAME_MAX];
+};
+
+/* sequence of commands that are sent to the card in one go */
+struct pcimax_plan {
+	size_t count;
+	/* called with a description of every value that is encoded into
+	 * the plan, NULL to stay quiet */
+	void (*note)(const char *text);
+	struct pcimax_frame frames[PCIMAX_PLAN_MAX];
+};
+
+/* priority classes of the command scheduler, commands of a higher class
+ * are sent before commands of a lower class at the next command boundary */
+enum pcimax_priority {
+	PCIMAX_PRIO_URGENT,	/* traffic announcements, RDS enable */
+	PCIMAX_PRIO_HIGH,	/* what the listener sees right away */
+	PCIMAX_PRIO_NORMAL,
+	PCIMAX_PRIO_BACKGROUND,	/* bulk updates: AF list, PS slots */
+	PCIMAX_PRIO_COUNT
+};
+
+/* kinds of commands that take the card different times to process, each
+ * can be calibrated separately */
+enum pcimax_cmd_class {
+	PCIMAX_CLASS_FLAG,	/* short flags and codes */
+	PCIMAX_CLASS_TUNE,	/* transmitter frequency / power (FF, FO, FW) */
+	PCIMAX_CLASS_TEXT,	/* RT, 64 byte payloads */
+	PCIMAX_CLASS_PS,	/* station name and its slots */
+	PCIMAX_CLASS_COUNT
+};
+
+/* a setting that can be addressed by name, as used in the config file, on
+ * the command line (--set-<name>) and in the control protocol of the
+ * daemon. Parsing, comparing, sending, scheduling and the help of the
+ * settings are driven by the table of these (pcimax_keys) */
+struct pcimax_key {
+	const char *section;	/* section in the config file */
+	const char *name;
+	uint32_t bit;		/* PCIMAX_* bit of the setting */
+	const char *cmd;	/* command, if the value is sent by one */
+	size_t offset;		/* value in struct pcimax_values */
+	size_t size;		/* size of the value, max length + 1 of texts */
+	bool (*parse)(struct pcimax_values *settings,
+		      const struct pcimax_key *key, const char *value);
+	void (*format)(const struct pcimax_values *settings,
+		       const struct pcimax_key *key, char *buf);
+	/* adds the commands of the setting to a plan, settings that are
+	 * sent together have it only at the first of them */
+	void (*encode)(struct pcimax_plan *plan,
+		       const struct pcimax_values *settings,
+		       const struct pcimax_key *key);
+	/* scheduling of the commands */
+	enum pcimax_priority priority;	/* while the card is on air */
+	enum pcimax_priority replay;	/* replay to a reconnected card */
+	enum pcimax_cmd_class cls;	/* processing time on the card */
+	bool probe;		/* harmless to send again, used to calibrate */
+	/* command line, settings without arg have no --set-<name> */
+	char opt;		/* short option of --set-<name>, 0 if none */
+	const char *arg;	/* --help: value of --set-<name> */
+	const char *help;	/* --help: description, one line each */
+};
+
+/* buffer size for the formatted value of a setting */
+#define PCIMAX_VALUE_MAX	256
+
+/* all settings, terminated by an entry without name */
+extern const struct pcimax_key pcimax_keys[];
+/* commands that belong to a group of settings rather than a single one
+ * (PCIMAX_FM commit, PCIMAX_RDS enable, PCIMAX_PS_SLOTS), they can't be
+ * set by name, terminated by an entry without name */
+extern const struct pcimax_key pcimax_group_keys[];
+
+/* a pcimax3000+ card found on the system */
+struct pcimax_device {
+	char device[PATH_MAX];	/* path of the tty device */
+	char syspath[PATH_MAX];	/* sysfs path of the tty device */
+	char link[PATH_MAX];	/* stable by-id name, empty if unknown */
+	char serial[PCIMAX_SERIAL_MAX];	/* USB serial, empty if unknown */
+};
+
+/* an opened card */
+struct pcimax;
+
+/** handle API **/
+
+/* opens the card at @device and sets up its serial line, the card is
+ * assumed to have none of the settings yet
+ * @handle:	set to the handle of the card */
+int pcimax_open(const char *device, struct pcimax **handle);
+/* restores the serial line setup and closes the card */
+void pcimax_close(struct pcimax *handle);
+/* max time the card gets per command, PCIMAX_DEFAULT_DELAY by default,
+ * a card that answers gets the next command right away */
+void pcimax_set_delay(struct pcimax *handle, uint32_t ms);
+/* sends the defined values of @settings that the card doesn't have yet */
+int pcimax_apply(struct pcimax *handle, const struct pcimax_values *settings);
+/* parses and sends a single setting, e.g. "rt", "Artist - Title" */
+int pcimax_set(struct pcimax *handle, const char *name, const char *value);
+/* current value of a setting, as it is accepted by pcimax_set
+ * @buf:	buffer of PCIMAX_VALUE_MAX bytes */
+int pcimax_get(const struct pcimax *handle, const char *name, char *buf);
+/* settings the card got through the handle */
+const struct pcimax_values *pcimax_get_values(const struct pcimax *handle);
+
+/** device discovery **/
+
+/* searches the tty devices of the system for pcimax3000+ cards
+ * @ret_val:	number of cards stored in @devices, negative errno value on
+ *		error */
+int pcimax_discover(struct pcimax_device *devices, size_t max);
+/* fills in the sysfs path and the USB serial of the card at
+ * @device->device, as far as they can be found */
+void pcimax_identify(struct pcimax_device *device);
+/* checks if a udev tty device belongs to a pcimax3000+ card
+ * @serial:	buffer of PCIMAX_SERIAL_MAX bytes for the USB serial of the
+ *		card, empty if it is unknown, may be NULL */
+struct udev_device;
+bool pcimax_is_card(struct udev_device *dev, char *serial);
+
+/** settings **/
+
+/* looks up a setting in a hash table that is built when the library is
+ * loaded
+ * @ret_val:	the setting named @name, NULL if there is none */
+const struct pcimax_key *pcimax_find_key(const char *name);
+/* @ret_val:	the (first) setting or group of the PCIMAX_* bit @field,
+ *		NULL if there is none */
+const struct pcimax_key *pcimax_field_key(uint32_t field);
+/* @ret_val:	bitmask of the fields defined in @new that differ from @old,
+ *		the PCIMAX_FM / PCIMAX_RDS group bits are set when the group
+ *		wasn't defined in @old */
+uint32_t pcimax_values_diff(const struct pcimax_values *old,
+			    const struct pcimax_values *new);
+/* copies the fields selected by @mask from @src to @dst */
+void pcimax_values_copy(struct pcimax_values *dst,
+			const struct pcimax_values *src, uint32_t mask);
+/* @ret_val:	true if the fields selected by @mask are equal */
+bool pcimax_values_equal(const struct pcimax_values *a,
+			 const struct pcimax_values *b, uint32_t mask);
+
+/** command plans **/
+
+/* empties a plan
+ * @note:	receives the descriptions of the encoded values, may be NULL */
+void pcimax_plan_init(struct pcimax_plan *plan, void (*note)(const char *text));
+/* appends a framed command to a plan
+ * @ret_val:	false if it doesn't fit */
+bool pcimax_plan_add(struct pcimax_plan *plan, uint32_t field,
+		     const char *cmd, const char *data, size_t data_count);
+/* adds the commands of the FM settings in @mask, followed by their commit */
+void pcimax_plan_fm(struct pcimax_plan *plan,
+		    const struct pcimax_values *settings, uint32_t mask);
+/* adds the commands of the RDS settings in @mask, PCIMAX_RDS enables the
+ * RDS output */
+void pcimax_plan_rds(struct pcimax_plan *plan,
+		     const struct pcimax_values *settings, uint32_t mask);
+/* removes the commands that don't change anything on the card
+ * @settings:	settings the plan was generated from
+ * @known:	settings the card is known to have, NULL if unknown */
+void pcimax_plan_optimize(struct pcimax_plan *plan,
+			  const struct pcimax_values *settings,
+			  const struct pcimax_values *known);
+/* copies the command mnemonic of a frame into @cmd (PCIMAX_CMD_MAX + 1) */
+void pcimax_frame_cmd(const struct pcimax_frame *frame, char *cmd);
+/* @len:	set to the number of data bytes of the frame
+ * @ret_val:	data of the frame */
+const char *pcimax_frame_data(const struct pcimax_frame *frame, size_t *len);
+/* describes the value a frame carries, decoded the way the card reads it,
+ * e.g. "103.50 MHz" for FF
+ * @buf:	buffer of PCIMAX_VALUE_MAX bytes */
+void pcimax_frame_describe(const struct pcimax_frame *frame, char *buf);
+
+/** serial line **/
+
+/* opens the serial line of a card non-blocking and sets it up for the card
+ * @old:	set to the previous setup of the line
+ * @ret_val:	file descriptor, negative errno value on error */
+int pcimax_serial_open(const char *device, struct termios *old);
+/* restores the setup of the line and closes it */
+void pcimax_serial_close(int fd, const struct termios *old);
+/* writes as much of the buffers in @iov as the line accepts
+ * @iov:	array of buffers, advanced past the written data
+ * @iovcnt:	number of buffers in @iov, updated
+ * @ret_val:	1 if everything was written, 0 if the line can't take more
+ *		data right now, negative errno value on error */
+int pcimax_write_iov(int fd, struct iovec **iov, int *iovcnt);
+/* writes a frame, waits for the line to accept it */
+int pcimax_frame_write(int fd, const struct pcimax_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCIMAX_H */